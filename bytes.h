@@ -0,0 +1,49 @@
+/* See LICENSE file for copyright and license details */
+
+#ifndef BYTES_H__
+#define BYTES_H__
+
+#include <stdint.h>
+
+/*
+ * Little endian fields in file formats and headers, read
+ * and written a byte at a time so alignment does not
+ * matter.
+ */
+
+static inline uint16_t get16(const uint8_t *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static inline uint32_t get32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t get64(const uint8_t *p)
+{
+	return get32(p) | (uint64_t)get32(p + 4) << 32;
+}
+
+static inline void le16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static inline void le32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static inline void le64(uint8_t *p, uint64_t v)
+{
+	le32(p, v);
+	le32(p + 4, v >> 32);
+}
+
+#endif
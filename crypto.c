@@ -0,0 +1,344 @@
+/* See LICENSE file for copyright and license details */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__linux__) && defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/kdf.h>
+#include <openssl/rand.h>
+
+#include "crypto.h"
+
+int
+crypto_best_cipher(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("aes") &&
+	    __builtin_cpu_supports("pclmul"))
+		return CIPHER_AES_GCM;
+#elif defined(__linux__) && defined(__aarch64__)
+	if ((getauxval(AT_HWCAP) & (HWCAP_AES | HWCAP_PMULL)) ==
+	    (HWCAP_AES | HWCAP_PMULL))
+		return CIPHER_AES_GCM;
+#endif
+	return CIPHER_CHACHA20_POLY1305;
+}
+
+static int
+hexval(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	c = tolower(c);
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+void
+crypto_read_psk(const char *path, unsigned char *psk)
+{
+	unsigned char buf[2 * CRYPTO_KEY_LEN + 2];
+	ssize_t len;
+	int fd, i, hi, lo;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		err(1, "open %s", path);
+	len = read(fd, buf, sizeof(buf));
+	if (len < 0)
+		err(1, "read %s", path);
+	close(fd);
+
+	/* Raw key */
+	if (len == CRYPTO_KEY_LEN) {
+		memcpy(psk, buf, CRYPTO_KEY_LEN);
+		memset(buf, 0, sizeof(buf));
+		return;
+	}
+
+	/* Hex encoded key, optionally followed by a newline */
+	if (len > 2 * CRYPTO_KEY_LEN && buf[2 * CRYPTO_KEY_LEN] == '\n')
+		len = 2 * CRYPTO_KEY_LEN;
+	if (len != 2 * CRYPTO_KEY_LEN)
+		errx(1, "%s: key must be %d raw bytes or %d hex digits",
+		     path, CRYPTO_KEY_LEN, 2 * CRYPTO_KEY_LEN);
+	for (i = 0; i < CRYPTO_KEY_LEN; i++) {
+		hi = hexval(buf[2 * i]);
+		lo = hexval(buf[2 * i + 1]);
+		if (hi < 0 || lo < 0)
+			errx(1, "%s: invalid hex digit", path);
+		psk[i] = hi << 4 | lo;
+	}
+	memset(buf, 0, sizeof(buf));
+}
+
+void
+crypto_hkdf(const void *salt, size_t saltlen, const void *ikm, size_t ikmlen,
+	    const void *info, size_t infolen, void *out, size_t outlen)
+{
+	EVP_PKEY_CTX *pctx;
+
+	pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+	if (!pctx)
+		errx(1, "EVP_PKEY_CTX_new_id");
+	if (EVP_PKEY_derive_init(pctx) <= 0 ||
+	    EVP_PKEY_CTX_set_hkdf_md(pctx, EVP_sha256()) <= 0 ||
+	    (saltlen && EVP_PKEY_CTX_set1_hkdf_salt(pctx, salt, saltlen) <= 0) ||
+	    EVP_PKEY_CTX_set1_hkdf_key(pctx, ikm, ikmlen) <= 0 ||
+	    EVP_PKEY_CTX_add1_hkdf_info(pctx, info, infolen) <= 0 ||
+	    EVP_PKEY_derive(pctx, out, &outlen) <= 0)
+		errx(1, "HKDF failed");
+	EVP_PKEY_CTX_free(pctx);
+}
+
+void
+crypto_derive(const void *secret, size_t len, const void *info,
+	      size_t infolen, struct crypto_key *key)
+{
+	unsigned char out[CRYPTO_KEY_LEN + CRYPTO_SALT_LEN];
+
+	crypto_hkdf(NULL, 0, secret, len, info, infolen, out, sizeof(out));
+	memcpy(key->key, out, CRYPTO_KEY_LEN);
+	memcpy(key->salt, out + CRYPTO_KEY_LEN, CRYPTO_SALT_LEN);
+	memset(out, 0, sizeof(out));
+}
+
+void
+crypto_keygen(unsigned char *priv, unsigned char *pub)
+{
+	EVP_PKEY *pkey;
+	size_t len;
+
+	crypto_random(priv, CRYPTO_DH_LEN);
+	pkey = EVP_PKEY_new_raw_private_key(EVP_PKEY_X25519, NULL,
+					    priv, CRYPTO_DH_LEN);
+	if (!pkey)
+		errx(1, "EVP_PKEY_new_raw_private_key");
+	len = CRYPTO_DH_LEN;
+	if (EVP_PKEY_get_raw_public_key(pkey, pub, &len) <= 0)
+		errx(1, "EVP_PKEY_get_raw_public_key");
+	EVP_PKEY_free(pkey);
+}
+
+int
+crypto_dh(const unsigned char *priv, const unsigned char *peer,
+	  unsigned char *shared)
+{
+	EVP_PKEY *ours, *theirs;
+	EVP_PKEY_CTX *pctx;
+	size_t len = CRYPTO_DH_LEN;
+	int ret = -1;
+
+	ours = EVP_PKEY_new_raw_private_key(EVP_PKEY_X25519, NULL,
+					    priv, CRYPTO_DH_LEN);
+	theirs = EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, NULL,
+					     peer, CRYPTO_DH_LEN);
+	if (!ours || !theirs)
+		goto out;
+	pctx = EVP_PKEY_CTX_new(ours, NULL);
+	if (!pctx)
+		goto out;
+	/* This fails for an all zero result */
+	if (EVP_PKEY_derive_init(pctx) > 0 &&
+	    EVP_PKEY_derive_set_peer(pctx, theirs) > 0 &&
+	    EVP_PKEY_derive(pctx, shared, &len) > 0)
+		ret = 0;
+	EVP_PKEY_CTX_free(pctx);
+out:
+	EVP_PKEY_free(ours);
+	EVP_PKEY_free(theirs);
+	return ret;
+}
+
+void
+crypto_hmac(const void *key, size_t keylen, const void *data,
+	    size_t len, unsigned char *mac)
+{
+	unsigned int maclen = CRYPTO_MAC_LEN;
+
+	if (!HMAC(EVP_sha256(), key, keylen, data, len, mac, &maclen))
+		errx(1, "HMAC failed");
+}
+
+int
+crypto_memcmp(const void *a, const void *b, size_t len)
+{
+	return CRYPTO_memcmp(a, b, len);
+}
+
+void
+crypto_init(struct crypto_ctx *ctx, const struct crypto_key *key, int enc)
+{
+	crypto_free(ctx);
+	ctx->enc = enc;
+	ctx->key = *key;
+	/* Sequence numbers start over with a new key */
+	ctx->replay_init = 0;
+}
+
+void
+crypto_free(struct crypto_ctx *ctx)
+{
+	int i;
+
+	for (i = 0; i < NR_CIPHERS; i++) {
+		if (ctx->evp[i])
+			EVP_CIPHER_CTX_free(ctx->evp[i]);
+		ctx->evp[i] = NULL;
+	}
+	memset(&ctx->key, 0, sizeof(ctx->key));
+}
+
+int
+crypto_replay_check(const struct crypto_ctx *ctx, uint32_t seq)
+{
+	uint32_t back;
+
+	if (!ctx->replay_init || (int32_t)(seq - ctx->replay_top) > 0)
+		return 0;
+	back = ctx->replay_top - seq;
+	if (back >= CRYPTO_REPLAY_WINDOW)
+		return -1;
+	return ctx->replay_bits & (1ULL << back) ? -1 : 0;
+}
+
+void
+crypto_replay_update(struct crypto_ctx *ctx, uint32_t seq)
+{
+	uint32_t ahead;
+
+	if (!ctx->replay_init) {
+		ctx->replay_top = seq;
+		ctx->replay_bits = 1;
+		ctx->replay_init = 1;
+		return;
+	}
+	if ((int32_t)(seq - ctx->replay_top) > 0) {
+		ahead = seq - ctx->replay_top;
+		ctx->replay_bits = ahead < CRYPTO_REPLAY_WINDOW ?
+			ctx->replay_bits << ahead : 0;
+		ctx->replay_bits |= 1;
+		ctx->replay_top = seq;
+	} else {
+		ctx->replay_bits |= 1ULL << (ctx->replay_top - seq);
+	}
+}
+
+/* Return the context for @cipher, the key schedule
+ * is only set up once and kept across packets */
+static EVP_CIPHER_CTX *
+get_evp(struct crypto_ctx *ctx, int cipher)
+{
+	const EVP_CIPHER *type;
+	EVP_CIPHER_CTX *evp;
+
+	if (cipher <= CIPHER_NONE || cipher >= NR_CIPHERS)
+		return NULL;
+	if (ctx->evp[cipher])
+		return ctx->evp[cipher];
+
+	if (cipher == CIPHER_AES_GCM)
+		type = EVP_aes_256_gcm();
+	else
+		type = EVP_chacha20_poly1305();
+
+	evp = EVP_CIPHER_CTX_new();
+	if (!evp)
+		errx(1, "EVP_CIPHER_CTX_new");
+	if (!EVP_CipherInit_ex(evp, type, NULL, ctx->key.key, NULL,
+			       ctx->enc))
+		errx(1, "EVP_CipherInit_ex");
+	ctx->evp[cipher] = evp;
+
+	return evp;
+}
+
+/* The nonce is the salt with the stream ID and the
+ * sequence number mixed in, unique for every packet
+ * of a given key */
+static void
+make_nonce(const struct crypto_ctx *ctx, uint32_t ssrc, uint32_t seq,
+	   unsigned char *nonce)
+{
+	int i;
+
+	memcpy(nonce, ctx->key.salt, CRYPTO_NONCE_LEN);
+	for (i = 0; i < 4; i++) {
+		nonce[i] ^= ssrc >> (24 - 8 * i);
+		nonce[8 + i] ^= seq >> (24 - 8 * i);
+	}
+}
+
+int
+crypto_seal(struct crypto_ctx *ctx, int cipher, uint32_t ssrc,
+	    uint32_t seq, const void *aad, size_t aadlen,
+	    unsigned char *buf, size_t len)
+{
+	EVP_CIPHER_CTX *evp;
+	unsigned char nonce[CRYPTO_NONCE_LEN];
+	int outl;
+
+	evp = get_evp(ctx, cipher);
+	if (!evp)
+		return -1;
+
+	make_nonce(ctx, ssrc, seq, nonce);
+	if (!EVP_EncryptInit_ex(evp, NULL, NULL, NULL, nonce) ||
+	    !EVP_EncryptUpdate(evp, NULL, &outl, aad, aadlen) ||
+	    !EVP_EncryptUpdate(evp, buf, &outl, buf, len) ||
+	    !EVP_EncryptFinal_ex(evp, buf + outl, &outl) ||
+	    !EVP_CIPHER_CTX_ctrl(evp, EVP_CTRL_AEAD_GET_TAG,
+				 CRYPTO_TAG_LEN, buf + len))
+		return -1;
+
+	return 0;
+}
+
+int
+crypto_open(struct crypto_ctx *ctx, int cipher, uint32_t ssrc,
+	    uint32_t seq, const void *aad, size_t aadlen,
+	    unsigned char *buf, size_t len)
+{
+	EVP_CIPHER_CTX *evp;
+	unsigned char nonce[CRYPTO_NONCE_LEN];
+	int outl;
+
+	if (len < CRYPTO_TAG_LEN)
+		return -1;
+	len -= CRYPTO_TAG_LEN;
+
+	evp = get_evp(ctx, cipher);
+	if (!evp)
+		return -1;
+
+	make_nonce(ctx, ssrc, seq, nonce);
+	if (!EVP_DecryptInit_ex(evp, NULL, NULL, NULL, nonce) ||
+	    !EVP_CIPHER_CTX_ctrl(evp, EVP_CTRL_AEAD_SET_TAG,
+				 CRYPTO_TAG_LEN, buf + len) ||
+	    !EVP_DecryptUpdate(evp, NULL, &outl, aad, aadlen) ||
+	    !EVP_DecryptUpdate(evp, buf, &outl, buf, len) ||
+	    EVP_DecryptFinal_ex(evp, buf + outl, &outl) <= 0)
+		return -1;
+
+	return 0;
+}
+
+void
+crypto_random(void *buf, size_t len)
+{
+	if (RAND_bytes(buf, len) != 1)
+		errx(1, "RAND_bytes failed");
+}
@@ -0,0 +1,92 @@
+/* See LICENSE file for copyright and license details */
+
+#ifndef CRYPTO_H__
+#define CRYPTO_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Ciphers, as carried in the packet header */
+#define CIPHER_NONE			0
+#define CIPHER_AES_GCM			1
+#define CIPHER_CHACHA20_POLY1305	2
+#define NR_CIPHERS			3
+
+#define CRYPTO_KEY_LEN		32
+#define CRYPTO_SALT_LEN		12
+#define CRYPTO_NONCE_LEN	12
+#define CRYPTO_TAG_LEN		16
+#define CRYPTO_DH_LEN		32
+#define CRYPTO_MAC_LEN		32
+
+/* Keying material for one direction of the stream */
+struct crypto_key {
+	unsigned char key[CRYPTO_KEY_LEN];
+	unsigned char salt[CRYPTO_SALT_LEN];
+};
+
+/* Sequence numbers further back than this from the
+ * newest one are taken as replays */
+#define CRYPTO_REPLAY_WINDOW	64
+
+/* Cipher state for one direction, must only
+ * be used by a single thread at a time */
+struct crypto_ctx {
+	/* Set for the sending side */
+	int enc;
+	struct crypto_key key;
+	/* Per cipher EVP_CIPHER_CTX, keyed on first use */
+	void *evp[NR_CIPHERS];
+	/* Receiving side, newest sequence number accepted
+	 * under this key and a bit for each of the ones
+	 * before it, bit 0 being the newest */
+	uint32_t replay_top;
+	uint64_t replay_bits;
+	int replay_init;
+};
+
+/* Cipher to use when sending, AES-GCM if the
+ * CPU has AES instructions and ChaCha20-Poly1305
+ * otherwise */
+int crypto_best_cipher(void);
+/* Read a 32 byte pre-shared key, raw or in hex */
+void crypto_read_psk(const char *path, unsigned char *psk);
+/* HKDF-SHA256, extract and expand in one go */
+void crypto_hkdf(const void *salt, size_t saltlen,
+		 const void *ikm, size_t ikmlen,
+		 const void *info, size_t infolen,
+		 void *out, size_t outlen);
+/* Expand @secret into a key and salt with HKDF-SHA256 */
+void crypto_derive(const void *secret, size_t len,
+		   const void *info, size_t infolen,
+		   struct crypto_key *key);
+/* Generate an ephemeral X25519 key pair */
+void crypto_keygen(unsigned char *priv, unsigned char *pub);
+/* X25519 shared secret, fails on a low order @peer */
+int crypto_dh(const unsigned char *priv, const unsigned char *peer,
+	      unsigned char *shared);
+/* HMAC-SHA256 */
+void crypto_hmac(const void *key, size_t keylen, const void *data,
+		 size_t len, unsigned char *mac);
+/* Constant time comparison, 0 if equal */
+int crypto_memcmp(const void *a, const void *b, size_t len);
+void crypto_init(struct crypto_ctx *ctx, const struct crypto_key *key,
+		 int enc);
+void crypto_free(struct crypto_ctx *ctx);
+/* Encrypt @len bytes at @buf in place and append the tag,
+ * @aad is authenticated but left in the clear */
+int crypto_seal(struct crypto_ctx *ctx, int cipher, uint32_t ssrc,
+		uint32_t seq, const void *aad, size_t aadlen,
+		unsigned char *buf, size_t len);
+/* Verify and decrypt in place, @len includes the tag */
+int crypto_open(struct crypto_ctx *ctx, int cipher, uint32_t ssrc,
+		uint32_t seq, const void *aad, size_t aadlen,
+		unsigned char *buf, size_t len);
+/* Returns -1 if @seq was already accepted under the
+ * current key or is too old to tell, 0 otherwise */
+int crypto_replay_check(const struct crypto_ctx *ctx, uint32_t seq);
+/* Mark @seq accepted, only once crypto_open() passed */
+void crypto_replay_update(struct crypto_ctx *ctx, uint32_t seq);
+void crypto_random(void *buf, size_t len);
+
+#endif
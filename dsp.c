@@ -0,0 +1,171 @@
+/* See LICENSE file for copyright and license details */
+
+#include <math.h>
+#include <stdint.h>
+
+#include "dsp.h"
+
+/* Frames of speech kept after the last speech frame */
+#define VAD_HANGOVER	10
+/* Speech is this much above the noise floor */
+#define VAD_SNR		4.0
+/* Loud enough to be speech whatever the spectrum */
+#define VAD_SNR_LOUD	16.0
+/* Frames to learn the noise floor from */
+#define VAD_WARMUP	10
+/* Below this the input is digital silence */
+#define VAD_MIN_FLOOR	1.0
+
+void
+vad_init(struct vad *v)
+{
+	v->floor = 0;
+	v->floor_tilt = 2.0;
+	v->hangover = 0;
+	v->frames = 0;
+}
+
+/*
+ * Two features per frame: the energy, and the energy of the
+ * first difference relative to it.  The latter is about 2 for
+ * white noise and well below 1 for voiced speech, which has
+ * most of its energy under 1kHz.  Both loops are plain integer
+ * reductions the compiler vectorizes.
+ */
+int
+vad_frame(struct vad *v, const int16_t *pcm, unsigned int len)
+{
+	int64_t e = 0, ed = 0;
+	int32_t d;
+	double energy, tilt;
+	unsigned int i;
+	int speech;
+
+	if (!len)
+		return 0;
+
+	for (i = 0; i < len; i++)
+		e += (int32_t)pcm[i] * pcm[i];
+	/* Halved so the square fits in 32 bits */
+	for (i = 1; i < len; i++) {
+		d = ((int32_t)pcm[i] - pcm[i - 1]) >> 1;
+		ed += d * d;
+	}
+
+	energy = (double)e / len;
+	tilt = energy > 0 ? 4.0 * ed / e : 2.0;
+
+	if (v->frames < VAD_WARMUP) {
+		/* Take the quietest frame as the floor to start
+		 * with, and send everything until then */
+		v->frames++;
+		if (v->frames == 1 || energy < v->floor) {
+			v->floor = energy;
+			v->floor_tilt = tilt;
+		}
+		return 1;
+	}
+
+	speech = energy > v->floor * VAD_SNR &&
+		energy > VAD_MIN_FLOOR &&
+		(tilt < 1.5 || energy > v->floor * VAD_SNR_LOUD);
+
+	if (!speech) {
+		/* Follow the noise down at once, up slowly */
+		if (energy < v->floor)
+			v->floor = energy;
+		else
+			v->floor += (energy - v->floor) / 64;
+		v->floor_tilt += (tilt - v->floor_tilt) / 16;
+	} else {
+		/* Let a floor stuck below the noise creep up */
+		v->floor *= 1.002;
+	}
+	if (v->floor < VAD_MIN_FLOOR)
+		v->floor = VAD_MIN_FLOOR;
+
+	if (speech) {
+		v->hangover = VAD_HANGOVER;
+		return 1;
+	}
+	if (v->hangover) {
+		v->hangover--;
+		return 1;
+	}
+	return 0;
+}
+
+unsigned int
+vad_noise_level(const struct vad *v)
+{
+	double dbov;
+
+	dbov = 10 * log10(v->floor / (32767.0 * 32767.0));
+	if (dbov > 0)
+		return 0;
+	if (dbov < -127)
+		return 127;
+	return (unsigned int)-dbov;
+}
+
+/* The tilt in 1/64ths, 128 is white noise */
+unsigned int
+vad_noise_tilt(const struct vad *v)
+{
+	double t = v->floor_tilt * 64;
+
+	if (t < 0)
+		return 0;
+	if (t > 255)
+		return 255;
+	return (unsigned int)t;
+}
+
+void
+cng_init(struct cng *c)
+{
+	c->seed = 22222;
+	c->gain = 0;
+	c->pole = 0;
+	c->last = 0;
+}
+
+/*
+ * The noise is white noise through a one pole filter.  For
+ * y[n] = x[n] + a y[n - 1] the first difference carries
+ * 2 (1 - a) times the energy of y, which gives the pole from
+ * the tilt, and y has 1 / (1 - a^2) times the energy of x.
+ */
+void
+cng_set(struct cng *c, unsigned int level, unsigned int tilt)
+{
+	double rms;
+
+	c->pole = 1.0 - tilt / 128.0;
+	if (c->pole > 0.95)
+		c->pole = 0.95;
+	if (c->pole < -0.95)
+		c->pole = -0.95;
+	rms = 32767.0 * pow(10, -(double)level / 20);
+	/* A uniform variable in [-1, 1] has an rms of 1 / sqrt(3) */
+	c->gain = rms * sqrt(3.0 * (1 - c->pole * c->pole));
+}
+
+void
+cng_frame(struct cng *c, int16_t *pcm, unsigned int len)
+{
+	unsigned int i;
+	double x, y;
+
+	for (i = 0; i < len; i++) {
+		c->seed = c->seed * 1664525 + 1013904223;
+		x = ((int32_t)c->seed / 2147483648.0) * c->gain;
+		y = x + c->pole * c->last;
+		c->last = y;
+		if (y > 32767)
+			y = 32767;
+		if (y < -32768)
+			y = -32768;
+		pcm[i] = (int16_t)y;
+	}
+}
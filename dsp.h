@@ -0,0 +1,44 @@
+/* See LICENSE file for copyright and license details */
+
+#ifndef DSP_H__
+#define DSP_H__
+
+#include <stdint.h>
+
+/* Voice activity detector, one per stream */
+struct vad {
+	/* Noise floor as mean square per sample and the
+	 * spectral tilt of the noise, see vad_frame() */
+	double floor;
+	double floor_tilt;
+	/* Frames still counted as speech after it stopped */
+	int hangover;
+	/* Frames seen so far, the floor settles first */
+	unsigned int frames;
+};
+
+void vad_init(struct vad *v);
+/* Classify a frame of 16 bit samples, returns 1 for
+ * speech, including the hangover after it */
+int vad_frame(struct vad *v, const int16_t *pcm, unsigned int len);
+/* Noise floor in -dBov and its tilt, for comfort noise */
+unsigned int vad_noise_level(const struct vad *v);
+unsigned int vad_noise_tilt(const struct vad *v);
+
+/* Comfort noise generator */
+struct cng {
+	uint32_t seed;
+	/* Gain of the white excitation and the pole
+	 * that shapes it */
+	double gain;
+	double pole;
+	double last;
+};
+
+void cng_init(struct cng *c);
+/* Match the noise described by vad_noise_level()
+ * and vad_noise_tilt() */
+void cng_set(struct cng *c, unsigned int level, unsigned int tilt);
+void cng_frame(struct cng *c, int16_t *pcm, unsigned int len);
+
+#endif
@@ -0,0 +1,260 @@
+/* See LICENSE file for copyright and license details */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "bytes.h"
+#include "ogg.h"
+
+/* Header type flags */
+#define OGG_CONTINUED	0x01
+#define OGG_BOS		0x02
+#define OGG_EOS		0x04
+
+static uint32_t crc_table[256];
+
+/* The Ogg CRC is the unreflected CRC-32 with
+ * polynomial 0x04c11db7 and no final xor */
+static void
+crc_init(void)
+{
+	uint32_t r;
+	int i, j;
+
+	if (crc_table[1])
+		return;
+	for (i = 0; i < 256; i++) {
+		r = (uint32_t)i << 24;
+		for (j = 0; j < 8; j++)
+			r = r & 0x80000000 ? (r << 1) ^ 0x04c11db7 : r << 1;
+		crc_table[i] = r;
+	}
+}
+
+static uint32_t
+crc_update(uint32_t crc, const uint8_t *p, size_t len)
+{
+	while (len--)
+		crc = (crc << 8) ^ crc_table[(crc >> 24) ^ *p++];
+	return crc;
+}
+
+void
+ogg_init(struct ogg_stream *os, uint32_t serial)
+{
+	crc_init();
+	os->serial = serial;
+	os->pageno = 0;
+	os->granule = 0;
+	os->bos = 1;
+	os->packets = 0;
+	os->nsegs = 0;
+	os->len = 0;
+}
+
+int
+ogg_packet(struct ogg_stream *os, const void *data, size_t len,
+	   uint64_t granule)
+{
+	unsigned int nsegs, i;
+
+	/* A packet that is a multiple of 255 bytes ends
+	 * with a zero lacing value */
+	nsegs = len / 255 + 1;
+	if (os->nsegs + nsegs > OGG_MAX_SEGMENTS ||
+	    os->len + len > OGG_MAX_DATA)
+		return -1;
+
+	for (i = 0; i < nsegs - 1; i++)
+		os->lacing[os->nsegs++] = 255;
+	os->lacing[os->nsegs++] = len % 255;
+	memcpy(os->data + os->len, data, len);
+	os->len += len;
+	os->granule = granule;
+	os->packets++;
+	return 0;
+}
+
+size_t
+ogg_page_size(const struct ogg_stream *os)
+{
+	return OGG_HEADER_SIZE + os->nsegs + os->len;
+}
+
+size_t
+ogg_flush(struct ogg_stream *os, uint8_t *buf, int eos)
+{
+	uint8_t *p = buf;
+	uint32_t crc;
+
+	memcpy(p, "OggS", 4);
+	p[4] = 0;
+	p[5] = (os->bos ? OGG_BOS : 0) | (eos ? OGG_EOS : 0);
+	/* -1 when no packet ends on this page */
+	le64(p + 6, os->packets ? os->granule : (uint64_t)-1);
+	le32(p + 14, os->serial);
+	le32(p + 18, os->pageno);
+	le32(p + 22, 0);
+	p[26] = os->nsegs;
+	p += OGG_HEADER_SIZE;
+	memcpy(p, os->lacing, os->nsegs);
+	p += os->nsegs;
+	memcpy(p, os->data, os->len);
+	p += os->len;
+
+	crc = crc_update(0, buf, p - buf);
+	le32(buf + 22, crc);
+
+	os->bos = 0;
+	os->pageno++;
+	os->packets = 0;
+	os->nsegs = 0;
+	os->len = 0;
+	return p - buf;
+}
+
+void
+ogg_discard(struct ogg_stream *os)
+{
+	os->pageno++;
+	os->packets = 0;
+	os->nsegs = 0;
+	os->len = 0;
+}
+
+size_t
+ogg_page_parse(const uint8_t *p, size_t size, struct ogg_page *pg)
+{
+	size_t len;
+	uint32_t crc;
+	unsigned int i;
+
+	if (size < OGG_HEADER_SIZE || memcmp(p, "OggS", 4) || p[4])
+		return 0;
+	pg->flags = p[5];
+	pg->granule = get64(p + 6);
+	pg->serial = get32(p + 14);
+	pg->pageno = get32(p + 18);
+	pg->nsegs = p[26];
+	pg->lacing = p + OGG_HEADER_SIZE;
+	pg->body = pg->lacing + pg->nsegs;
+
+	len = OGG_HEADER_SIZE + pg->nsegs;
+	if (size < len)
+		return 0;
+	for (i = 0; i < pg->nsegs; i++)
+		len += pg->lacing[i];
+	if (size < len)
+		return 0;
+
+	/* The CRC is taken with its own field zeroed */
+	crc = crc_update(0, p, 22);
+	crc = crc_update(crc, (const uint8_t *)"\0\0\0\0", 4);
+	crc = crc_update(crc, p + 26, len - 26);
+	if (crc != get32(p + 22))
+		return 0;
+	return len;
+}
+
+void
+ogg_reader_init(struct ogg_reader *r, const uint8_t *data, size_t size)
+{
+	crc_init();
+	r->data = data;
+	r->size = size;
+	r->off = 0;
+	r->have_serial = 0;
+	r->page.nsegs = 0;
+	r->seg = 0;
+	r->body_off = 0;
+}
+
+long
+ogg_read_packet(struct ogg_reader *r, uint8_t *buf, size_t size,
+		uint64_t *granule, int *last)
+{
+	size_t len = 0, n;
+	unsigned int seg, i;
+
+	for (;;) {
+		if (r->seg == r->page.nsegs) {
+			n = ogg_page_parse(r->data + r->off, r->size - r->off,
+					   &r->page);
+			if (!n)
+				return -1;
+			r->off += n;
+			r->seg = 0;
+			r->body_off = 0;
+			if (!r->have_serial) {
+				r->serial = r->page.serial;
+				r->have_serial = 1;
+			}
+			/* Another logical stream */
+			if (r->page.serial != r->serial) {
+				r->seg = r->page.nsegs;
+				continue;
+			}
+			/* A page with no segments, such as a bare
+			 * end of stream */
+			if (!r->page.nsegs)
+				continue;
+			/* The tail of a packet we never saw the
+			 * start of */
+			if ((r->page.flags & OGG_CONTINUED) && !len) {
+				while (r->seg < r->page.nsegs &&
+				       r->page.lacing[r->seg] == 255)
+					r->body_off += r->page.lacing[r->seg++];
+				if (r->seg < r->page.nsegs)
+					r->body_off += r->page.lacing[r->seg++];
+				continue;
+			}
+		}
+
+		seg = r->page.lacing[r->seg++];
+		if (buf) {
+			if (len + seg > size)
+				return -1;
+			memcpy(buf + len, r->page.body + r->body_off, seg);
+		}
+		len += seg;
+		r->body_off += seg;
+		if (seg == 255)
+			continue;
+
+		*granule = r->page.granule;
+		*last = 1;
+		for (i = r->seg; i < r->page.nsegs; i++)
+			if (r->page.lacing[i] < 255)
+				*last = 0;
+		return len;
+	}
+}
+
+size_t
+opus_head(uint8_t *buf, int channels, unsigned int preskip, uint32_t rate)
+{
+	memcpy(buf, "OpusHead", 8);
+	buf[8] = 1;
+	buf[9] = channels;
+	le16(buf + 10, preskip);
+	le32(buf + 12, rate);
+	/* No output gain, mono or stereo mapping */
+	le16(buf + 16, 0);
+	buf[18] = 0;
+	return 19;
+}
+
+size_t
+opus_tags(uint8_t *buf, size_t size, const char *vendor)
+{
+	size_t len = strlen(vendor);
+
+	if (size < 8 + 4 + len + 4)
+		return 0;
+	memcpy(buf, "OpusTags", 8);
+	le32(buf + 8, len);
+	memcpy(buf + 12, vendor, len);
+	le32(buf + 12 + len, 0);
+	return 12 + len + 4;
+}
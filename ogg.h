@@ -0,0 +1,99 @@
+/* See LICENSE file for copyright and license details */
+
+#ifndef OGG_H__
+#define OGG_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Ogg Opus muxing, see RFC 3533 and RFC 7845.  Packets
+ * are gathered into a page, a finished page is written
+ * out to memory the caller provides.  Packets are never
+ * split across pages when muxing, reading takes them
+ * either way. */
+
+#define OGG_MAX_SEGMENTS	255
+#define OGG_MAX_DATA		8192
+#define OGG_HEADER_SIZE		27
+/* Largest page ogg_flush() writes */
+#define OGG_MAX_PAGE		(OGG_HEADER_SIZE + OGG_MAX_SEGMENTS + \
+				 OGG_MAX_DATA)
+
+struct ogg_stream {
+	uint32_t serial;
+	uint32_t pageno;
+	/* Granule position at the end of the last packet */
+	uint64_t granule;
+	/* Next page is the first of the stream */
+	int bos;
+	/* Page being filled */
+	unsigned int packets;
+	unsigned int nsegs;
+	uint8_t lacing[OGG_MAX_SEGMENTS];
+	size_t len;
+	uint8_t data[OGG_MAX_DATA];
+};
+
+void ogg_init(struct ogg_stream *os, uint32_t serial);
+/* Add a packet ending at @granule to the page, returns
+ * -1 if it does not fit and the page must be flushed */
+int ogg_packet(struct ogg_stream *os, const void *data, size_t len,
+	       uint64_t granule);
+/* Size of the page as it stands */
+size_t ogg_page_size(const struct ogg_stream *os);
+/* Finish the page into @buf, which has room for
+ * ogg_page_size(), and start the next one.  With @eos
+ * this is the last page of the stream.  Returns the
+ * size written. */
+size_t ogg_flush(struct ogg_stream *os, uint8_t *buf, int eos);
+/* Drop the page being filled, the next page number
+ * then shows the loss */
+void ogg_discard(struct ogg_stream *os);
+
+/* A page parsed in place */
+struct ogg_page {
+	uint8_t flags;
+	uint64_t granule;
+	uint32_t serial;
+	uint32_t pageno;
+	unsigned int nsegs;
+	const uint8_t *lacing;
+	const uint8_t *body;
+};
+
+/* Parse and check the page at @p, returns its size or 0
+ * if there is no whole, valid page there */
+size_t ogg_page_parse(const uint8_t *p, size_t size, struct ogg_page *pg);
+
+/* Packets of the first logical stream in a buffer of
+ * pages, read in order */
+struct ogg_reader {
+	const uint8_t *data;
+	size_t size;
+	/* Offset of the next page */
+	size_t off;
+	uint32_t serial;
+	int have_serial;
+	/* Page being read and the next segment in it */
+	struct ogg_page page;
+	unsigned int seg;
+	size_t body_off;
+};
+
+void ogg_reader_init(struct ogg_reader *r, const uint8_t *data, size_t size);
+/* Copy the next packet into @buf and set @granule to that
+ * of the page it ends on, and @last if no other packet
+ * ends on that page after it.  With no @buf the packet is
+ * skipped.  Returns the length, or -1 at the end of the
+ * data or at a packet over @size. */
+long ogg_read_packet(struct ogg_reader *r, uint8_t *buf, size_t size,
+		     uint64_t *granule, int *last);
+
+/* Identification header, @buf needs 19 bytes */
+size_t opus_head(uint8_t *buf, int channels, unsigned int preskip,
+		 uint32_t rate);
+/* Comment header with no comments, returns the size
+ * or 0 if it does not fit in @size */
+size_t opus_tags(uint8_t *buf, size_t size, const char *vendor);
+
+#endif
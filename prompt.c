@@ -0,0 +1,126 @@
+/* See LICENSE file for copyright and license details */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytes.h"
+#include "prompt.h"
+
+int
+prompt_open(struct prompt *p, const uint8_t *data, size_t size)
+{
+	uint32_t index, off, i;
+
+	if (size < PROMPT_HEADER_SIZE ||
+	    memcmp(data, PROMPT_MAGIC, 8) ||
+	    get32(data + 8) != PROMPT_VERSION)
+		return -1;
+	p->data = data;
+	p->size = size;
+	p->frame_size = get32(data + 12);
+	p->nframes = get32(data + 16);
+	index = get32(data + 20);
+	if (index < PROMPT_HEADER_SIZE || index > size ||
+	    (size - index) / 4 < p->nframes)
+		return -1;
+	p->index = data + index;
+
+	/* Checked once here, so prompt_frame() need not */
+	for (i = 0; i < p->nframes; i++) {
+		off = get32(p->index + i * 4);
+		if (off < PROMPT_HEADER_SIZE || off > index - 2 ||
+		    get16(data + off) > index - 2 - off)
+			return -1;
+	}
+	return 0;
+}
+
+const uint8_t *
+prompt_frame(const struct prompt *p, uint32_t n, size_t *len)
+{
+	const uint8_t *frame;
+
+	frame = p->data + get32(p->index + n * 4);
+	*len = get16(frame);
+	return frame + 2;
+}
+
+int
+prompt_create(struct prompt_writer *w, FILE *fp, uint32_t frame_size)
+{
+	uint8_t header[PROMPT_HEADER_SIZE];
+
+	w->fp = fp;
+	w->frame_size = frame_size;
+	w->nframes = 0;
+	w->off = PROMPT_HEADER_SIZE;
+	w->index = NULL;
+	w->alloc = 0;
+
+	/* Filled in by prompt_finish() */
+	memset(header, 0, sizeof(header));
+	if (fwrite(header, sizeof(header), 1, fp) != 1)
+		return -1;
+	return 0;
+}
+
+int
+prompt_add(struct prompt_writer *w, const void *frame, size_t len)
+{
+	uint32_t *index;
+	uint8_t hdr[2];
+
+	if (len > UINT16_MAX || UINT32_MAX - w->off < len + 2) {
+		errno = EFBIG;
+		return -1;
+	}
+	if (w->nframes == w->alloc) {
+		w->alloc = w->alloc ? w->alloc * 2 : 1024;
+		index = realloc(w->index, w->alloc * sizeof(*index));
+		if (!index)
+			return -1;
+		w->index = index;
+	}
+	w->index[w->nframes++] = w->off;
+
+	le16(hdr, len);
+	if (fwrite(hdr, sizeof(hdr), 1, w->fp) != 1 ||
+	    (len && fwrite(frame, len, 1, w->fp) != 1))
+		return -1;
+	w->off += len + 2;
+	return 0;
+}
+
+int
+prompt_finish(struct prompt_writer *w)
+{
+	uint8_t buf[PROMPT_HEADER_SIZE];
+	uint32_t i;
+	int ret = -1;
+
+	for (i = 0; i < w->nframes; i++) {
+		le32(buf, w->index[i]);
+		if (fwrite(buf, 4, 1, w->fp) != 1)
+			goto out;
+	}
+
+	memset(buf, 0, sizeof(buf));
+	memcpy(buf, PROMPT_MAGIC, 8);
+	le32(buf + 8, PROMPT_VERSION);
+	le32(buf + 12, w->frame_size);
+	le32(buf + 16, w->nframes);
+	le32(buf + 20, w->off);
+	if (fseek(w->fp, 0, SEEK_SET) < 0 ||
+	    fwrite(buf, sizeof(buf), 1, w->fp) != 1 ||
+	    fflush(w->fp) == EOF)
+		goto out;
+	ret = 0;
+out:
+	free(w->index);
+	w->index = NULL;
+	return ret;
+}
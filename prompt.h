@@ -0,0 +1,60 @@
+/* See LICENSE file for copyright and license details */
+
+#ifndef PROMPT_H__
+#define PROMPT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Prompt cache, Opus frames encoded ahead of time to be
+ * sent as they are.  All fields are little endian:
+ *
+ *	header	magic, version, frame duration in 16 kHz
+ *		samples, frame count, index offset, all
+ *		32 bit but the magic, padded to 32 bytes
+ *	frames	16 bit length, then the Opus frame
+ *	index	32 bit offset of each frame
+ *
+ * Frame n starts at the offset in index entry n, so
+ * sending can start anywhere without reading what comes
+ * before.  Frames are back to back in time, DTX frames
+ * are kept as they are. */
+
+#define PROMPT_MAGIC		"SSPROMPT"
+#define PROMPT_VERSION		1
+#define PROMPT_HEADER_SIZE	32
+
+/* A cache mapped in memory, read only */
+struct prompt {
+	const uint8_t *data;
+	size_t size;
+	uint32_t frame_size;
+	uint32_t nframes;
+	const uint8_t *index;
+};
+
+/* Check the cache in @data, returns -1 if it is not one
+ * or any frame lies outside of it */
+int prompt_open(struct prompt *p, const uint8_t *data, size_t size);
+/* Frame @n and its length, @n must be below nframes */
+const uint8_t *prompt_frame(const struct prompt *p, uint32_t n, size_t *len);
+
+/* Writing a cache, frames are added in order */
+struct prompt_writer {
+	FILE *fp;
+	uint32_t frame_size;
+	uint32_t nframes;
+	/* Where the next frame goes */
+	uint32_t off;
+	uint32_t *index;
+	size_t alloc;
+};
+
+/* These return -1 with errno set on failure */
+int prompt_create(struct prompt_writer *w, FILE *fp, uint32_t frame_size);
+int prompt_add(struct prompt_writer *w, const void *frame, size_t len);
+/* Write the index and the header, @fp is left open */
+int prompt_finish(struct prompt_writer *w);
+
+#endif
@@ -0,0 +1,152 @@
+/* See LICENSE file for copyright and license details */
+
+#ifndef RING_H__
+#define RING_H__
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Single producer, single consumer ring of fixed size
+ * elements.  The producer and the consumer may run on
+ * different threads without any locking, as long as there
+ * is only one of each.
+ *
+ * Elements are used in place: get a slot, fill it in or
+ * read it, then publish or release it.
+ */
+
+struct ring {
+	/* Written by the producer only */
+	unsigned int head __attribute__ ((aligned (64)));
+	/* Written by the consumer only */
+	unsigned int tail __attribute__ ((aligned (64)));
+	unsigned int mask __attribute__ ((aligned (64)));
+	size_t esize;
+	unsigned char *buf;
+};
+
+/**
+ * ring_init - allocate the ring
+ * @r: the ring
+ * @count: number of elements, must be a power of 2
+ * @esize: size of each element
+ *
+ * Returns 0 on success, -1 if the allocation failed.
+ */
+static inline int ring_init(struct ring *r, unsigned int count, size_t esize)
+{
+	r->head = 0;
+	r->tail = 0;
+	r->mask = count - 1;
+	r->esize = esize;
+	r->buf = calloc(count, esize);
+	return r->buf ? 0 : -1;
+}
+
+static inline void ring_free(struct ring *r)
+{
+	free(r->buf);
+	r->buf = NULL;
+}
+
+/**
+ * ring_count - number of elements waiting in the ring
+ * @r: the ring
+ *
+ * Exact for the consumer and the producer, a snapshot for
+ * anyone else.
+ */
+static inline unsigned int ring_count(const struct ring *r)
+{
+	return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) -
+		__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * ring_slot - producer side, next free slot
+ * @r: the ring
+ *
+ * Returns NULL if the ring is full.
+ */
+static inline void *ring_slot(struct ring *r)
+{
+	unsigned int tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+	if (r->head - tail > r->mask)
+		return NULL;
+	return r->buf + (r->head & r->mask) * r->esize;
+}
+
+/**
+ * ring_publish - producer side, hand the slot from ring_slot()
+ * over to the consumer
+ * @r: the ring
+ */
+static inline void ring_publish(struct ring *r)
+{
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * ring_peek - consumer side, oldest element
+ * @r: the ring
+ *
+ * Returns NULL if the ring is empty.
+ */
+static inline void *ring_peek(struct ring *r)
+{
+	unsigned int head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+	if (head == r->tail)
+		return NULL;
+	return r->buf + (r->tail & r->mask) * r->esize;
+}
+
+/**
+ * ring_release - consumer side, give the element from
+ * ring_peek() back to the producer
+ * @r: the ring
+ */
+static inline void ring_release(struct ring *r)
+{
+	__atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * ring_push - copy an element in
+ * @r: the ring
+ * @elem: the element, @r->esize bytes
+ *
+ * Returns -1 if the ring is full.
+ */
+static inline int ring_push(struct ring *r, const void *elem)
+{
+	void *slot = ring_slot(r);
+
+	if (!slot)
+		return -1;
+	memcpy(slot, elem, r->esize);
+	ring_publish(r);
+	return 0;
+}
+
+/**
+ * ring_pop - copy the oldest element out
+ * @r: the ring
+ * @elem: where to put it, @r->esize bytes
+ *
+ * Returns -1 if the ring is empty.
+ */
+static inline int ring_pop(struct ring *r, void *elem)
+{
+	void *slot = ring_peek(r);
+
+	if (!slot)
+		return -1;
+	memcpy(elem, slot, r->esize);
+	ring_release(r);
+	return 0;
+}
+
+#endif
@@ -0,0 +1,63 @@
+/* See LICENSE file for copyright and license details */
+
+/* For CPU affinity */
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "rt.h"
+
+int
+rt_set_priority(int policy, int prio)
+{
+	struct sched_param sp;
+
+	if (prio < sched_get_priority_min(policy) ||
+	    prio > sched_get_priority_max(policy))
+		return EINVAL;
+
+	memset(&sp, 0, sizeof(sp));
+	sp.sched_priority = prio;
+	return pthread_setschedparam(pthread_self(), policy, &sp);
+}
+
+int
+rt_set_cpu(int cpu)
+{
+#ifdef __linux__
+	cpu_set_t set;
+
+	if (cpu < 0 || cpu >= CPU_SETSIZE)
+		return EINVAL;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+	(void)cpu;
+	return ENOSYS;
+#endif
+}
+
+int
+rt_lock_memory(void)
+{
+#ifdef __GLIBC__
+	/* Keep freed memory around rather than giving it back
+	 * and faulting it in again later */
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+#endif
+	/* With MCL_FUTURE new mappings, thread stacks included,
+	 * are faulted in up front */
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+		return errno;
+	return 0;
+}
@@ -0,0 +1,16 @@
+/* See LICENSE file for copyright and license details */
+
+#ifndef RT_H__
+#define RT_H__
+
+/* Give the calling thread a real-time @policy and
+ * priority, returns 0 or an errno value */
+int rt_set_priority(int policy, int prio);
+/* Pin the calling thread to @cpu, returns 0 or
+ * an errno value */
+int rt_set_cpu(int cpu);
+/* Lock all current and future memory, the process
+ * should not page fault once it is running */
+int rt_lock_memory(void);
+
+#endif
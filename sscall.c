@@ -10,27 +10,175 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <sys/time.h>
 #include <time.h>
 #include <stdint.h>
+#include <stdarg.h>
+#include <poll.h>
+#include <sched.h>
+#include <semaphore.h>
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif
 
 #include <ao/ao.h>
 #include <pthread.h>
 #include <speex/speex_resampler.h>
+#include <speex/speex_echo.h>
+#include <speex/speex_preprocess.h>
 #include <opus/opus.h>
 
 #include "list.h"
+#include "ring.h"
 #include "arg.h"
+#include "crypto.h"
+#include "rt.h"
+#include "dsp.h"
+#include "timer.h"
+#include "ogg.h"
+#include "prompt.h"
+#include "wav.h"
 
 char *argv0;
 
 /* Input/Output PCM buffer size */
 #define FRAME_SIZE (320)
+#define LEN(x) (sizeof(x) / sizeof((x)[0]))
+
 /* Input/Output compressed buffer size */
 #define COMPRESSED_BUF_SIZE (1500)
+/* Receive buffer space the kernel charges per small datagram */
+#define RCVBUF_TRUESIZE (2048)
+/* Start of frame signature */
+#define PKT_SIG (0xcafebabe)
+/* Wire protocol version, see PROTOCOL */
+#define PKT_VERSION (1)
+/* Packet types */
+#define PKT_MEDIA (0)
+#define PKT_HELLO (1)
+#define PKT_CN (2)
+/* Handshake retransmit interval in ms */
+#define HELLO_INTERVAL (250)
+/* A running session only restarts for a new hello once
+ * nothing from the peer authenticated for this many ms,
+ * longer than the gap between comfort noise packets */
+#define PEER_QUIET (1000)
+/* And never within this many ms of the last restart */
+#define RESTART_HOLDOFF (2000)
+/* Largest Opus packet */
+#define MAX_OPUS_PACKET (1275)
+/* Packets allowed per second from a single source */
+#define RATE_PPS (200)
+/* Packets a source may send in a burst above that */
+#define RATE_BURST (100)
+/* Number of rate limiter buckets, a power of 2 */
+#define RATE_BUCKETS (256)
+/* Packets waiting for playback before we drop */
+#define MAX_QUEUED (50)
+/* Frames decoded ahead of the sink, a power of 2 */
+#define PCM_LOOKAHEAD (8)
+/* Frames queued between two capture stages, a power of 2 */
+#define TX_QUEUE (8)
+/* Duration of a frame in ns */
+#define FRAME_NS (FRAME_SIZE * 1000000000ULL / 16000)
+/* Frames between two comfort noise updates in silence */
+#define CN_INTERVAL (20)
+/* Lost frames concealed in a row, beyond that it is silence */
+#define PLC_MAX (5)
+/* Control socket clients served at once */
+#define CTL_MAX_CLIENTS (4)
+/* Longest control command line */
+#define CTL_LINE_SIZE (256)
+/* Replies held for a client that does not read them,
+ * beyond that it is dropped */
+#define CTL_OUT_MAX (256 * 1024)
+/* Thread stack size with -L, all of it is locked */
+#define THREAD_STACK_SIZE (256 * 1024)
+/* Longest echo path the canceller models, in ms */
+#define AEC_TAIL (200)
+/* Echo reference frames in flight, enough to cover
+ * the sink latency, must be a power of 2 */
+#define AEC_REF (64)
+/* Frames the complexity governor looks at before it
+ * decides, and the share of a frame's duration in percent
+ * encoding may take before complexity goes down, or
+ * stay under for GOV_CALM decisions before it goes up */
+#define GOV_WINDOW (50)
+#define GOV_HIGH (40)
+#define GOV_LOW (15)
+#define GOV_CALM (5)
+/* Load shedding on the receive path.  Time a packet may
+ * sit in the queue beyond the jitter target in ms before
+ * it counts as a deadline miss, misses per GOV_WINDOW
+ * packets that raise the level and quiet windows before
+ * it goes down again. */
+#define SHED_DELAY (60)
+#define SHED_MISSES (5)
+#define SHED_CALM (5)
+/* Decoders kept ready in the pool, a call needs one */
+#define CODEC_POOL (1)
+/* Buckets of the setup time histograms, powers of 2 in
+ * usec, the last one takes everything above */
+#define NR_HIST (12)
+/* Recording with -w.  Buffers the writer thread takes
+ * whole, their size and alignment, frames per Ogg page,
+ * how often in ms a partly filled buffer is written out
+ * anyway, and the longest gap in frames marked as lost,
+ * ten minutes without a packet.  Silence is filled in as
+ * comfort noise comes in, so this only takes outages, the
+ * recording skips longer ones. */
+#define REC_BUFS (8)
+#define REC_BUF_SIZE (64 * 1024)
+#define REC_ALIGN (4096)
+#define REC_PAGE_FRAMES (50)
+#define REC_FLUSH (5000)
+#define REC_GAP_MAX (30000)
+/* Encoder delay of the peer at 48 kHz, which is what
+ * opus_encoder_ctl(OPUS_GET_LOOKAHEAD) gives for 16 kHz
+ * VoIP */
+#define REC_PRESKIP (312)
+/* Largest Opus packet sent, room is left for the
+ * header and the tag */
+#define PLAY_MAX (COMPRESSED_BUF_SIZE - sizeof(struct compressed_header) - \
+		  CRYPTO_TAG_LEN)
+/* Comfort noise for silence in the -f file, in -dBov.  The
+ * file does not say what its background sounds like, so
+ * it is faint white noise. */
+#define PLAY_CN_LEVEL (70)
+
+/* Reasons for dropping a packet on ingress */
+enum {
+	REJECT_SHORT,
+	REJECT_SIG,
+	REJECT_VERSION,
+	REJECT_TYPE,
+	REJECT_LENGTH,
+	REJECT_SOURCE,
+	REJECT_RATE,
+	REJECT_AUTH,
+	REJECT_REPLAY,
+	REJECT_QUEUE,
+	NR_REJECT
+};
+
+static const char *reject_names[NR_REJECT] = {
+	[REJECT_SHORT] = "short",
+	[REJECT_SIG] = "signature",
+	[REJECT_VERSION] = "version",
+	[REJECT_TYPE] = "type",
+	[REJECT_LENGTH] = "length",
+	[REJECT_SOURCE] = "source",
+	[REJECT_RATE] = "rate",
+	[REJECT_AUTH] = "auth",
+	[REJECT_REPLAY] = "replay",
+	[REJECT_QUEUE] = "queue full",
+};
 
 /* Command line option, bits per sample */
 static int fbits;
@@ -42,26 +190,183 @@ static int fchan;
 static int fdevid;
 /* Command line option, verbosity flag */
 static int fverbose;
+/* Command line option, pre-shared key file */
+static char *fkeyfile;
+/* Command line option, session ticket file */
+static char *fticketfile;
+/* Command line option, send the stream in the clear */
+static int fnocrypt;
+/* Command line option, accept packets from any address */
+static int fanysrc;
+/* Command line option, control socket path */
+static char *fctlpath;
+/* Command line option, pacing offset in milliseconds */
+static int fpace;
+/* Command line option, let the kernel pace with SO_TXTIME,
+ * only honoured by the fq and etf qdiscs */
+static int fpace_kernel;
+/* Command line option, real-time priority of the audio
+ * threads, 0 to leave them alone */
+static int frtprio;
+/* Command line option, SCHED_FIFO or SCHED_RR */
+static int frtpolicy = SCHED_FIFO;
+/* Command line option, lock all memory */
+static int fmlock;
+/* Command line option, run all capture stages on one thread */
+static int fserial;
+/* Command line option, do not send silence */
+static int fvad;
+/* Command line option, cancel echo, the sink plays a frame
+ * this many ms after taking it, -1 to leave echo alone */
+static int faec = -1;
+/* Command line option, suppress noise and level the input */
+static int fpreprocess;
+/* Command line option, release the decoder after this many
+ * seconds without anything to decode, 0 to keep it */
+static int fhibernate;
+/* Command line option, record what we receive to this
+ * Ogg Opus file */
+static char *frecord;
+/* Command line option, send the packets of this Ogg Opus
+ * file instead of encoding the input */
+static char *fplay;
+/* Command line option, read the input from this file,
+ * WAV or raw samples, instead of the standard input */
+static char *finput;
+/* Input file with -i, mapped read-only */
+struct input_file {
+	const uint8_t *data;
+	size_t size;
+	struct pcm_format fmt;
+	/* Bytes of samples and frames read so far, and
+	 * when the first frame was */
+	size_t off;
+	uint64_t frames;
+	uint64_t start;
+} input_file;
+/* Command line option, start sending the -f file this
+ * many ms in */
+static int fplay_start;
+/* Command line option, encode the input into this prompt
+ * cache and exit */
+static char *fprompt;
+/* File sent with -f, mapped read-only so that everyone
+ * sending it shares its pages.  Ogg Opus or a prompt
+ * cache. */
+struct play_file {
+	const uint8_t *data;
+	size_t size;
+	int cache;
+	struct prompt prompt;
+} play_file;
 
 /* Opus encoder state */
 static OpusEncoder *opus_enc;
-/* Opus decoder state */
-static OpusDecoder *opus_dec;
-/* TX/RX Speex resampler state */
+/* Receive side codec state, owned by the decode thread.
+ * Set up when the first frame needs decoding, and with -H
+ * released again while the peer is silent. */
+struct rx_codec {
+	OpusDecoder *dec;
+	SpeexResamplerState *resampler;
+} rx_codec;
+
+/* Decoders and receive resamplers set up ahead of time,
+ * so that waking the receive side does not allocate.
+ * Only used by the decode thread once it runs. */
+struct codec_pool {
+	OpusDecoder *dec[CODEC_POOL];
+	SpeexResamplerState *resampler[CODEC_POOL];
+	int count;
+	/* Pairs in existence, in the pool or in use */
+	int allocated;
+	/* Library default decoder complexity, set on every
+	 * decoder taken out and restored after shedding.  -1
+	 * if the library has no such setting. */
+	int complexity;
+} codec_pool;
+/* TX cipher state, owned by the capture thread */
+static struct crypto_ctx tx_crypto;
+/* RX cipher state, owned by the main thread */
+static struct crypto_ctx rx_crypto;
+/* Set unless running in the clear, packets in the
+ * clear are refused then */
+static int crypto_enabled;
+/* Cipher used on the TX path */
+static int tx_cipher;
+/* Our stream ID */
+static uint32_t tx_ssrc;
+/* TX Speex resampler state */
 static SpeexResamplerState *speex_resampler_tx;
-static SpeexResamplerState *speex_resampler_rx;
+/* Echo canceller with -E, and the resampler that brings
+ * what the sink plays to 16kHz as its reference */
+static SpeexEchoState *speex_echo;
+static SpeexResamplerState *speex_resampler_ref;
+/* Noise suppression and gain control with -N */
+static SpeexPreprocessState *speex_preprocess;
 /* Libao handle */
 static ao_device *device;
 /* Output PCM thread */
 static pthread_t playback_thread;
+/* Decoder thread, feeds the output thread */
+static pthread_t decode_thread;
+/* Capture stages after the read, unless -S */
+static pthread_t dsp_thread;
+static pthread_t encode_thread;
 /* Input PCM thread */
 static pthread_t capture_thread;
+/* Pacer thread, used unless the kernel paces with SO_TXTIME */
+static pthread_t pacer_thread;
+/* Attributes every thread is created with */
+static pthread_attr_t thread_attr;
+
+/* Threads on the audio path, see rt_attach() */
+enum {
+	RT_RECEIVE,
+	RT_CAPTURE,
+	RT_PLAYBACK,
+	RT_PACER,
+	RT_DECODE,
+	RT_DSP,
+	RT_ENCODE,
+	NR_RT_THREADS
+};
+
+static const char *rt_names[NR_RT_THREADS] = {
+	[RT_RECEIVE] = "receive",
+	[RT_CAPTURE] = "capture",
+	[RT_PLAYBACK] = "playback",
+	[RT_PACER] = "pacer",
+	[RT_DECODE] = "decode",
+	[RT_DSP] = "dsp",
+	[RT_ENCODE] = "encode",
+};
+
+/* Command line option, CPU each audio thread is
+ * pinned to, -1 for any */
+static int fcpu[NR_RT_THREADS] = { [0 ... NR_RT_THREADS - 1] = -1 };
+
+/* Running average and maximum of some delay */
+struct latency {
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+};
 
 /* Compressed header at the start
  * of each compressed packet */
 struct compressed_header {
 	/* Start of frame signature */
 	uint32_t sig;
+	uint8_t version;
+	uint8_t type;
+	/* Cipher protecting the payload */
+	uint8_t cipher;
+	uint8_t reserved;
+	/* Stream ID, picked at random by the sender */
+	uint32_t ssrc;
+	/* Incremented by one for every packet sent */
+	uint32_t seq;
+	/* Capture time of the first sample */
 	uint32_t timestamp;
 } __attribute__ ((packed));
 
@@ -73,10 +378,86 @@ struct compressed_buf {
 	/* Compressed buffer size */
 	size_t len;
 	struct list_head list;
-	/* Pointer to the header of this buffer */
-	struct compressed_header *hdr;
+	/* PKT_MEDIA or PKT_CN, and the sequence number */
+	int type;
+	uint32_t seq;
+	/* When it was queued, in ns */
+	uint64_t queued;
 } compressed_buf;
 
+/* Handshake message, follows the compressed header
+ * in PKT_HELLO packets.  See PROTOCOL. */
+struct hello {
+	uint8_t flags;
+	uint8_t reserved[3];
+	/* Fresh for every session */
+	uint8_t random[16];
+	/* The peer's random, once we have seen it */
+	uint8_t echo[16];
+	/* Ephemeral X25519 key, or the ticket ID when resuming */
+	uint8_t key[CRYPTO_DH_LEN];
+	/* HMAC-SHA256 of the header and all the fields above */
+	uint8_t mac[CRYPTO_MAC_LEN];
+} __attribute__ ((packed));
+
+/* Comfort noise parameters, the payload of PKT_CN
+ * packets.  See PROTOCOL. */
+struct comfort_noise {
+	/* Noise level in -dBov */
+	uint8_t level;
+	/* Spectral tilt in 1/64ths, 128 is white */
+	uint8_t tilt;
+	uint8_t reserved[2];
+} __attribute__ ((packed));
+
+/* Hello flags */
+/* The key field holds a ticket ID */
+#define HELLO_RESUME (1 << 0)
+/* The sender knows we have its hello */
+#define HELLO_ACKED (1 << 1)
+
+/* Session ticket, lets a later call skip the key exchange */
+struct ticket {
+	int valid;
+	uint8_t id[16];
+	/* Resumption secret */
+	uint8_t secret[32];
+};
+
+/* Handshake state, only touched by the main thread */
+struct handshake {
+	/* Keys are in place in both directions */
+	int done;
+	/* Resuming from ticket */
+	int resume;
+	uint8_t psk[CRYPTO_KEY_LEN];
+	int have_psk;
+	/* Ticket for the next session */
+	struct ticket ticket;
+	/* Ticket this session was resumed from */
+	struct ticket session;
+	uint8_t priv[CRYPTO_DH_LEN];
+	uint8_t pub[CRYPTO_DH_LEN];
+	uint8_t random[16];
+	uint8_t peer_random[16];
+	int have_peer;
+	/* The peer echoed our random */
+	int peer_has_us;
+	/* Session secret of a full handshake */
+	uint8_t master[32];
+	uint64_t start;
+	uint64_t last_sent;
+	/* Last packet from the peer that authenticated, in ns */
+	uint64_t last_rx;
+} handshake;
+
+/* Timers of the main thread, in ms on CLOCK_MONOTONIC */
+static struct timer_wheel timers;
+/* Resend our hello until the peer has it */
+static struct timer hello_timer;
+/* Release the decoder once the peer stopped talking */
+static struct timer hibernate_timer;
+
 /* Private structure for the
  * capture thread */
 struct capture_priv {
@@ -86,293 +467,4233 @@ struct capture_priv {
 	int sockfd;
 	/* Client address info */
 	struct addrinfo *servinfo;
+	/* Written to when it is time to quit */
+	int wake[2];
 } capture_priv;
 
+/* Packet waiting in the pacer queue */
+struct paced_buf {
+	/* Complete packet, header included */
+	unsigned char *buf;
+	size_t len;
+	/* Departure time in ns on CLOCK_MONOTONIC */
+	uint64_t txtime;
+	struct list_head list;
+} paced_buf;
+
+/* Number of entries in compressed_buf, written under
+ * compressed_buf_lock but also read without it */
+static int compressed_buf_len;
+/* When the playback thread was last signalled, in ns */
+static uint64_t compressed_buf_signalled;
+
+/* Load shedding levels, each one sheds what the
+ * levels below it do as well */
+enum {
+	SHED_NONE,
+	/* Lost frames are no longer concealed */
+	SHED_CONCEAL,
+	/* Encoder and decoder complexity go down */
+	SHED_COMPLEXITY,
+	/* Packets queued past their deadline are dropped */
+	SHED_DROP,
+};
+
+/* Load shedding state, owned by the decode thread */
+struct shed {
+	/* Packets taken in the current window, and how
+	 * many of them were past their deadline */
+	unsigned int frames;
+	unsigned int misses;
+	/* Windows in a row without a miss */
+	unsigned int calm;
+};
+
+static struct shed rx_shed;
+/* Current level, the encode stage looks at it too */
+static int shed_level;
+
 /* Lock that protects compressed_buf */
 static pthread_mutex_t compressed_buf_lock;
 /* Condition variable on which ao_play() blocks */
 static pthread_cond_t tx_pcm_cond;
 
-/* State of the playback thread */
-struct playback_state {
-	int quit;
-} playback_state;
+/* Decoded frame on its way to the sink */
+struct pcm_frame {
+	/* When it was decoded, in ns */
+	uint64_t ready;
+	/* Length in bytes */
+	size_t len;
+	spx_int16_t pcm[];
+};
+
+/* Decoded frames, from the decode thread to
+ * the playback thread */
+static struct ring pcm_ring;
+/* Free slots and decoded frames in pcm_ring, the
+ * decode and playback threads sleep on these */
+static sem_t pcm_free;
+static sem_t pcm_ready;
+/* Comfort noise the playback thread fills gaps with, set
+ * by the decode thread.  CN_ACTIVE while the peer is
+ * silent, a count of updates in bits 16-23 and the level
+ * and tilt in the low 16 bits. */
+#define CN_ACTIVE (1U << 31)
+static uint32_t cn_params;
+
+/* Frame the sink took, the echo canceller's reference */
+struct aec_ref {
+	/* When it is heard, in ns */
+	uint64_t played;
+	spx_int16_t pcm[FRAME_SIZE];
+};
+
+/* From the playback thread to the DSP stage */
+static struct ring aec_ring;
+
+/* Samples in a frame at the sink rate, and room for
+ * a few more as the resampler does not always give
+ * exactly that many */
+static unsigned int pcm_frame_len;
+static unsigned int pcm_frame_max;
+/* Sample rate of the input, the sink's unless the input
+ * file says otherwise, and samples in a frame of it */
+static int in_rate;
+static unsigned int in_frame_len;
+
+/* State of the decode and playback threads */
+struct playback_state {
+	int quit;
+} playback_state;
+
+/* Frame on its way through the capture stages */
+struct tx_frame {
+	/* When it was read, in ns */
+	uint64_t read;
+	/* Offset of the frame in the capture stream,
+	 * in samples at 16kHz */
+	uint64_t pos;
+	/* Set by the DSP stage unless the frame is silence */
+	int speech;
+	/* Background noise, filled in with -D */
+	struct comfort_noise cn;
+	/* Samples in pcm */
+	spx_uint32_t len;
+	spx_int16_t pcm[];
+};
+
+/* Hand-off from one capture stage to the next */
+struct tx_link {
+	struct ring ring;
+	/* Free slots and queued frames */
+	sem_t free;
+	sem_t ready;
+};
+
+/* Capture stages: read, DSP, encode and send */
+enum {
+	TX_TO_DSP,
+	TX_TO_ENCODE,
+	NR_TX_LINKS
+};
+
+static struct tx_link tx_links[NR_TX_LINKS];
+/* Largest frame a stage handles, in samples */
+static unsigned int tx_frame_max;
+
+/* Encoder side state, owned by the encode stage */
+struct tx_encoder {
+	uint32_t seq;
+	int tx_key_gen;
+	int muted;
+	/* Silent frames since speech stopped */
+	unsigned int silent;
+};
+
+/* Voice activity detector, owned by the DSP stage */
+static struct vad tx_vad;
+
+/* Encoder complexity governor, owned by the encode stage */
+struct governor {
+	/* Complexity in use, left alone once set by hand */
+	int complexity;
+	int pinned;
+	/* Frames encoded in the current window, the CPU and
+	 * wall time that took and frames over their deadline */
+	unsigned int frames;
+	uint64_t cpu_ns;
+	uint64_t wall_ns;
+	unsigned int late;
+	/* Windows in a row with time to spare */
+	unsigned int calm;
+};
+
+static struct governor tx_gov;
+
+/* State of the capture threads */
+struct capture_state {
+	int quit;
+	/* TX key, picked up when tx_key_gen changes */
+	struct crypto_key tx_key;
+	int tx_key_gen;
+} capture_state;
+
+/* State of the pacer */
+struct pacer_state {
+	/* Set if the kernel paces for us via SO_TXTIME */
+	int txtime;
+	/* CLOCK_MONOTONIC time of sample offset 0, in ns */
+	int64_t anchor;
+	int anchored;
+	int quit;
+} pacer_state;
+
+#ifdef SO_TXTIME
+/* Same layout as struct sock_txtime, <linux/net_tstamp.h>
+ * cannot be pulled in as it clashes with our types.h */
+struct txtime_cfg {
+	clockid_t clockid;
+	uint32_t flags;
+};
+#endif
+
+/* Lock that protects paced_buf and pacer_state.quit */
+static pthread_mutex_t paced_buf_lock;
+/* Condition variable on which the pacer waits for packets */
+static pthread_cond_t paced_buf_cond;
+
+/* Lock that protects playback_state */
+static pthread_mutex_t playback_state_lock;
+/* Lock that protects capture_state */
+static pthread_mutex_t capture_state_lock;
+
+/* Call statistics, every field is written by
+ * a single thread only */
+struct stats {
+	/* Receive path, updated by the main thread */
+	uint64_t rx_packets;
+	uint64_t rx_bytes;
+	/* Packets missing from the stream, this includes
+	 * the ones counted in rx_queue_drops */
+	uint64_t rx_lost;
+	/* Packets dropped by the kernel because the
+	 * socket receive queue was full */
+	uint64_t rx_queue_drops;
+	/* Packets dropped on ingress, by reason.  Failed
+	 * authentication includes packets in the clear
+	 * while encryption is on. */
+	uint64_t rx_reject[NR_REJECT];
+	/* Time spent decrypting, in ns */
+	uint64_t rx_crypto_ns;
+	/* Interarrival jitter in samples, scaled by 16 */
+	uint32_t rx_jitter;
+	/* Largest number of packets drained in one go */
+	uint32_t rx_burst_max;
+	/* Current size of the socket receive buffer */
+	int rx_rcvbuf;
+	/* Send path, updated by the capture thread */
+	uint64_t tx_packets;
+	uint64_t tx_bytes;
+	/* Time spent encrypting, in ns */
+	uint64_t tx_crypto_ns;
+	/* Frames dropped waiting for the handshake */
+	uint64_t tx_nokey;
+	/* Silent frames not sent with -D, and comfort
+	 * noise updates sent and received instead */
+	uint64_t tx_suppressed;
+	uint64_t tx_cn;
+	uint64_t rx_cn;
+	/* Frames played as comfort noise, and lost frames
+	 * concealed, some of them with the FEC data in the
+	 * packet after them.  Set by the receive threads. */
+	uint64_t rx_cn_frames;
+	uint64_t rx_plc;
+	uint64_t rx_fec;
+	/* Completed handshakes, how many were resumed
+	 * and how long the last one took in usec */
+	uint32_t hs_count;
+	uint32_t hs_resumed;
+	uint64_t hs_usec;
+	/* Hellos with a new random that did not restart the
+	 * session, replays or a peer that is still talking */
+	uint64_t hs_refused;
+	/* Time from reading a frame to sending it, how long
+	 * encoding took and frames that took longer than
+	 * their own duration */
+	struct latency tx_latency;
+	struct latency tx_encode;
+	uint64_t tx_late;
+	/* Time from reading to sending again, for percentiles */
+	uint64_t tx_latency_hist[NR_HIST];
+	/* Time packets spent queued for the decoder, the
+	 * load shedding level, how often it went up and what
+	 * was shed.  Set by the decode thread. */
+	struct latency rx_queue_delay;
+	/* Memory held by the Opus encoder, how often the
+	 * decoder was released with -H, and how long setting
+	 * it up took */
+	int tx_codec_bytes;
+	uint64_t rx_hibernated;
+	uint64_t rx_setup[NR_HIST];
+	int rx_shed_level;
+	uint64_t rx_shed_raised;
+	uint64_t rx_shed_conceal;
+	/* Packets that missed their deadline in the queue,
+	 * and the time decoding and resampling a frame took */
+	uint64_t rx_late;
+	struct latency rx_decode;
+	uint64_t rx_decode_hist[NR_HIST];
+	uint64_t rx_shed_drops;
+	/* Decoder complexity calls refused, libopus before
+	 * 1.5 has no complexity setting for the decoder */
+	uint64_t rx_shed_refused;
+	/* Recording with -w: packets written, lost frames
+	 * marked for concealment, packets too late to be
+	 * written, jumps in the stream started anew from and
+	 * pages lost for want of a buffer.  Set by the main
+	 * thread, but for the bytes and write errors the
+	 * writer thread counts. */
+	uint64_t rec_packets;
+	uint64_t rec_plc;
+	uint64_t rec_late;
+	uint64_t rec_resync;
+	uint64_t rec_dropped;
+	uint64_t rec_bytes;
+	uint64_t rec_errors;
+	/* Encoder complexity and the times the governor
+	 * lowered and raised it */
+	int tx_complexity;
+	uint64_t tx_gov_down;
+	uint64_t tx_gov_up;
+	/* CPU time the echo canceller and the noise
+	 * suppressor take per frame */
+	struct latency tx_aec;
+	struct latency tx_preprocess;
+	/* Frames that reached the encoder and the Opus
+	 * payload sent for them, for the average bitrate */
+	uint64_t tx_frames;
+	uint64_t tx_opus_bytes;
+	/* How late each thread ran after the event that
+	 * should have woken it up, updated by that thread */
+	struct latency sched_lat[NR_RT_THREADS];
+	/* Times each thread went to sleep and woke up,
+	 * updated by that thread */
+	uint64_t wakeups[NR_RT_THREADS];
+} stats;
+
+/* Wake-ups as of the previous report and when that
+ * was, reports give the rate since then */
+static uint64_t wakeups_last[NR_RT_THREADS];
+static uint64_t wakeups_since;
+
+/* Receive side bookkeeping for the loss and jitter
+ * estimates, only touched by the main thread */
+struct rx_clock {
+	int valid;
+	/* Next sequence number we expect to see */
+	uint32_t expected;
+	/* Transit time of the previous packet, in samples */
+	int64_t transit;
+} rx_clock;
+
+/* Threads that log, each has its own ring */
+enum {
+	LOG_MAIN,
+	LOG_CAPTURE,
+	LOG_PLAYBACK,
+	LOG_PACER,
+	LOG_DECODE,
+	LOG_ENCODE,
+	NR_LOG_RINGS
+};
+
+/* Log levels */
+enum {
+	LOG_LVL_WARN,
+	LOG_LVL_INFO,
+	LOG_LVL_DEBUG
+};
+
+/* Log messages, formatted in log_format() */
+enum {
+	LOG_RX_PACKET,
+	LOG_STARVING,
+	LOG_DECODE_FAIL,
+	LOG_ENCODE_FAIL,
+	LOG_SEND_FAIL,
+	LOG_HANDSHAKE,
+	LOG_RCVBUF,
+	NR_LOG_TYPES
+};
+
+/* Log record, the hot path only fills these in
+ * and leaves the formatting to the log thread */
+struct log_rec {
+	int type;
+	/* errno at the time of the call */
+	int err;
+	int64_t arg[3];
+};
+
+/* Per message type settings and rate limit state */
+struct log_type {
+	/* Logged if this is at most the current log level,
+	 * everything is logged in verbose mode */
+	int level;
+	/* Messages allowed per second, 0 for no limit */
+	unsigned int rate;
+	/* Rate limit window, only used by the log thread */
+	time_t window;
+	unsigned int count;
+	unsigned int suppressed;
+};
+
+static struct log_type log_types[NR_LOG_TYPES] = {
+	[LOG_RX_PACKET] = { .level = LOG_LVL_DEBUG, .rate = 100 },
+	[LOG_STARVING] = { .level = LOG_LVL_DEBUG, .rate = 1 },
+	[LOG_DECODE_FAIL] = { .level = LOG_LVL_WARN, .rate = 5 },
+	[LOG_ENCODE_FAIL] = { .level = LOG_LVL_WARN, .rate = 5 },
+	[LOG_SEND_FAIL] = { .level = LOG_LVL_WARN, .rate = 5 },
+	[LOG_HANDSHAKE] = { .level = LOG_LVL_INFO },
+	[LOG_RCVBUF] = { .level = LOG_LVL_INFO },
+};
+
+/* Current log level, set from the control socket */
+static int log_level = LOG_LVL_WARN;
+
+/* Log thread */
+static pthread_t log_thread;
+static struct ring log_rings[NR_LOG_RINGS];
+/* Ring of the calling thread */
+static __thread struct ring *log_ring;
+/* Records lost because a ring was full, per ring */
+static uint64_t log_dropped[NR_LOG_RINGS];
+/* The log thread waits on this when all rings are empty */
+static int log_pipe[2];
+static int log_sleeping;
+static int log_quit;
+
+/* Threads that take commands from the control socket */
+enum {
+	CTL_CAPTURE,
+	CTL_DECODE,
+	NR_CTL_RINGS
+};
+
+/* Control commands passed on to the other threads */
+enum {
+	CTL_BITRATE,
+	CTL_COMPLEXITY,
+	CTL_FEC,
+	CTL_MUTE,
+	CTL_JITTER,
+	CTL_HIBERNATE
+};
+
+/* Reconfiguration request, the target thread applies it
+ * between two frames */
+struct ctl_cmd {
+	int op;
+	int value;
+};
+
+/* Commands from the main thread to each thread */
+static struct ring ctl_rings[NR_CTL_RINGS];
+
+/* Control socket connection */
+struct ctl_client {
+	int fd;
+	char line[CTL_LINE_SIZE];
+	size_t len;
+	/* Replies the socket did not take yet, sent on POLLOUT */
+	char *out;
+	size_t out_len;
+	size_t out_size;
+};
+
+/* Control socket, -1 if there is none */
+static int ctl_sockfd = -1;
+static struct ctl_client ctl_clients[CTL_MAX_CLIENTS];
+
+/* Set to 1 when SIGINT is received */
+static volatile sig_atomic_t handle_sigint;
+/* Set to 1 when SIGUSR2 is received */
+static volatile sig_atomic_t handle_sigusr2;
+/* Written to by the signal handler, so the main loop
+ * sees a signal delivered to any thread */
+static int sig_pipe[2];
+/* Audio thread the caller is, set by rt_attach() */
+static __thread int rt_self;
+
+static void
+set_nonblocking(int fd)
+{
+	int opts;
+
+	opts = fcntl(fd, F_GETFL);
+	if (opts < 0)
+		err(1, "fcntl");
+	opts = (opts | O_NONBLOCK);
+	if (fcntl(fd, F_SETFL, opts) < 0)
+		err(1, "fcntl");
+}
+
+/* Monotonic time in ns */
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* CPU time of the calling thread in ns */
+static uint64_t
+cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+latency_add(struct latency *lat, uint64_t ns)
+{
+	lat->count++;
+	lat->total_ns += ns;
+	if (ns > lat->max_ns)
+		lat->max_ns = ns;
+}
+
+/* Count @ns in the histogram bucket it falls in */
+static void
+hist_add(uint64_t *hist, uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	int i = 0;
+
+	while (us && i < NR_HIST - 1) {
+		us >>= 1;
+		i++;
+	}
+	hist[i]++;
+}
+
+static void
+sched_lat_add(int id, uint64_t ns)
+{
+	latency_add(&stats.sched_lat[id], ns);
+}
+
+/* The calling thread slept and woke up again */
+static void
+wakeup_add(void)
+{
+	stats.wakeups[rt_self]++;
+}
+
+/* sem_wait() that counts a wake-up only when it
+ * had to sleep */
+static void
+sem_sleep(sem_t *sem)
+{
+	if (!sem_trywait(sem))
+		return;
+	while (sem_wait(sem) < 0 && errno == EINTR)
+		;
+	wakeup_add();
+}
+
+/* Empty a non-blocking self-pipe */
+static void
+drain_pipe(int fd)
+{
+	char tmp[64];
+
+	while (read(fd, tmp, sizeof(tmp)) > 0)
+		;
+}
+
+/* Give the calling audio thread its real-time priority
+ * and CPU, called once as each thread starts */
+static void
+rt_attach(int id)
+{
+	int ret;
+
+	rt_self = id;
+	if (frtprio) {
+		ret = rt_set_priority(frtpolicy, frtprio);
+		if (ret)
+			warnx("%s thread: cannot set real-time priority: %s%s",
+			      rt_names[id], strerror(ret),
+			      ret == EPERM ? " (check RLIMIT_RTPRIO)" : "");
+	}
+
+	if (fcpu[id] >= 0) {
+		ret = rt_set_cpu(fcpu[id]);
+		if (ret)
+			warnx("%s thread: cannot pin to CPU %d: %s",
+			      rt_names[id], fcpu[id], strerror(ret));
+	}
+}
+
+/* Attach the calling thread to its log ring */
+static void
+log_attach(int id)
+{
+	log_ring = &log_rings[id];
+}
+
+/* Queue a log message, this never blocks nor allocates */
+static void
+log_event(int type, int64_t a0, int64_t a1, int64_t a2)
+{
+	struct log_rec *rec;
+	int saved = errno;
+	ssize_t ret;
+
+	if (log_types[type].level >
+	    __atomic_load_n(&log_level, __ATOMIC_RELAXED) && !fverbose)
+		return;
+
+	rec = ring_slot(log_ring);
+	if (!rec) {
+		log_dropped[log_ring - log_rings]++;
+		return;
+	}
+	rec->type = type;
+	rec->err = saved;
+	rec->arg[0] = a0;
+	rec->arg[1] = a1;
+	rec->arg[2] = a2;
+	ring_publish(log_ring);
+
+	/* Only wake the log thread if it went to sleep, a
+	 * full pipe wakes it up just as well */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&log_sleeping, __ATOMIC_SEQ_CST) &&
+	    __atomic_exchange_n(&log_sleeping, 0, __ATOMIC_SEQ_CST)) {
+		ret = write(log_pipe[1], "", 1);
+		(void)ret;
+	}
+	errno = saved;
+}
+
+static void
+log_format(const struct log_rec *rec)
+{
+	struct in_addr in;
+	char host[INET_ADDRSTRLEN];
+
+	switch (rec->type) {
+	case LOG_RX_PACKET:
+		in.s_addr = rec->arg[1];
+		inet_ntop(AF_INET, &in, host, sizeof(host));
+		printf("Received %lld bytes from %s\n",
+		       (long long)rec->arg[0], host);
+		break;
+	case LOG_STARVING:
+		printf("Output thread is starving...\n");
+		break;
+	case LOG_DECODE_FAIL:
+		fprintf(stderr, "%s: Failed to decode input packet: %lld\n",
+			argv0, (long long)rec->arg[0]);
+		break;
+	case LOG_ENCODE_FAIL:
+		fprintf(stderr, "%s: Failed to encode packet: %lld\n",
+			argv0, (long long)rec->arg[0]);
+		break;
+	case LOG_SEND_FAIL:
+		fprintf(stderr, "%s: send: %s\n", argv0, strerror(rec->err));
+		break;
+	case LOG_HANDSHAKE:
+		printf("Handshake %s in %lld usec\n",
+		       rec->arg[0] ? "resumed" : "done",
+		       (long long)rec->arg[1]);
+		break;
+	case LOG_RCVBUF:
+		printf("Receive buffer resized to %lld bytes\n",
+		       (long long)rec->arg[0]);
+		break;
+	default:
+		break;
+	}
+}
+
+/* Report what the rate limit of @lt held back */
+static void
+log_report(struct log_type *lt)
+{
+	if (lt->suppressed)
+		fprintf(stderr, "%s: %u similar messages suppressed\n",
+			argv0, lt->suppressed);
+	lt->suppressed = 0;
+}
+
+/* Report the messages suppressed in windows that are
+ * over, or in every window with @all.  Returns 1 if some
+ * are still held back, to be reported later. */
+static int
+log_flush_suppressed(int all)
+{
+	struct timespec ts;
+	int i, held = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	for (i = 0; i < NR_LOG_TYPES; i++) {
+		if (!log_types[i].suppressed)
+			continue;
+		if (all || ts.tv_sec != log_types[i].window)
+			log_report(&log_types[i]);
+		else
+			held = 1;
+	}
+	return held;
+}
+
+/* Apply the rate limit of the message type */
+static int
+log_allow(int type)
+{
+	struct log_type *lt = &log_types[type];
+	struct timespec ts;
+
+	if (!lt->rate)
+		return 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (ts.tv_sec != lt->window) {
+		log_report(lt);
+		lt->window = ts.tv_sec;
+		lt->count = 0;
+		lt->suppressed = 0;
+	}
+	if (lt->count >= lt->rate) {
+		lt->suppressed++;
+		return 0;
+	}
+	lt->count++;
+	return 1;
+}
+
+/* Format everything queued so far, returns the number
+ * of records seen */
+static int
+log_drain(void)
+{
+	struct log_rec *rec;
+	int i, n = 0;
+
+	for (i = 0; i < NR_LOG_RINGS; i++) {
+		while ((rec = ring_peek(&log_rings[i]))) {
+			if (log_allow(rec->type))
+				log_format(rec);
+			ring_release(&log_rings[i]);
+			n++;
+		}
+	}
+	if (n) {
+		fflush(stdout);
+		fflush(stderr);
+	}
+	return n;
+}
+
+/* Log thread, formats and writes out the records
+ * queued by the other threads */
+static void *
+logger(void *data)
+{
+	struct pollfd pfd;
+	char tmp[64];
+	int i, pending, held;
+
+	(void)data;
+
+	pfd.fd = log_pipe[0];
+	pfd.events = POLLIN;
+
+	do {
+		log_drain();
+		if (__atomic_load_n(&log_quit, __ATOMIC_SEQ_CST))
+			break;
+		/* Suppressed counts are otherwise only reported
+		 * when a later message of the same type comes */
+		held = log_flush_suppressed(0);
+
+		/* Announce we are going to sleep, then look
+		 * again so a record that raced with us is
+		 * not left behind */
+		__atomic_store_n(&log_sleeping, 1, __ATOMIC_SEQ_CST);
+		pending = 0;
+		for (i = 0; i < NR_LOG_RINGS; i++)
+			pending |= ring_count(&log_rings[i]) != 0;
+		if (pending) {
+			__atomic_store_n(&log_sleeping, 0, __ATOMIC_SEQ_CST);
+			continue;
+		}
+
+		/* Wake up for the end of the rate limit window
+		 * if something is held back */
+		if (poll(&pfd, 1, held ? 1000 : -1) > 0)
+			while (read(log_pipe[0], tmp, sizeof(tmp)) > 0)
+				;
+	} while (1);
+
+	log_drain();
+	log_flush_suppressed(1);
+
+	pthread_exit(NULL);
+
+	return NULL;
+}
+
+/* Lock memory and set up the thread attributes,
+ * before any thread is started */
+static void
+init_rt(void)
+{
+	int ret;
+
+	pthread_attr_init(&thread_attr);
+
+	if (!fmlock)
+		return;
+
+	ret = rt_lock_memory();
+	if (ret) {
+		errno = ret;
+		err(1, "mlockall");
+	}
+	/* Every thread stack is locked and faulted in when
+	 * it is created, keep them within RLIMIT_MEMLOCK */
+	pthread_attr_setstacksize(&thread_attr, THREAD_STACK_SIZE);
+}
+
+static void
+init_log(void)
+{
+	int i, ret;
+
+	for (i = 0; i < NR_LOG_RINGS; i++)
+		if (ring_init(&log_rings[i], 256, sizeof(struct log_rec)) < 0)
+			err(1, "malloc");
+
+	if (pipe(log_pipe) < 0)
+		err(1, "pipe");
+	set_nonblocking(log_pipe[0]);
+	set_nonblocking(log_pipe[1]);
+
+	log_attach(LOG_MAIN);
+
+	ret = pthread_create(&log_thread, &thread_attr, logger, NULL);
+	if (ret) {
+		errno = ret;
+		err(1, "pthread_create");
+	}
+}
+
+static void
+deinit_log(void)
+{
+	int i;
+
+	__atomic_store_n(&log_quit, 1, __ATOMIC_SEQ_CST);
+	if (write(log_pipe[1], "", 1) < 0)
+		warn("write");
+	pthread_join(log_thread, NULL);
+
+	close(log_pipe[0]);
+	close(log_pipe[1]);
+	for (i = 0; i < NR_LOG_RINGS; i++)
+		ring_free(&log_rings[i]);
+}
+
+/* Keep what the sink just took as the echo reference,
+ * it is heard once the sink latency has passed */
+static void
+aec_playback(const spx_int16_t *pcm, unsigned int len)
+{
+	struct aec_ref *ref;
+	spx_uint32_t inlen, outlen;
+
+	if (!speex_echo)
+		return;
+	/* The DSP stage is behind, it catches up on
+	 * what is queued */
+	ref = ring_slot(&aec_ring);
+	if (!ref)
+		return;
+	inlen = len;
+	outlen = FRAME_SIZE;
+	speex_resampler_process_int(speex_resampler_ref, 0, pcm, &inlen,
+				    ref->pcm, &outlen);
+	if (outlen < FRAME_SIZE)
+		memset(ref->pcm + outlen, 0,
+		       (FRAME_SIZE - outlen) * sizeof(ref->pcm[0]));
+	ref->played = now_ns() + faec * 1000000ULL;
+	ring_publish(&aec_ring);
+}
+
+/* Play back audio from the client */
+static void *
+playback(void *data)
+{
+	struct playback_state *state = data;
+	struct pcm_frame *frame;
+	struct cng cng;
+	spx_int16_t *noise;
+	uint32_t cn, cn_last = 0;
+	unsigned int cn_frames = 0;
+	int waited;
+	/* Audio went out since the last underrun */
+	int played = 0;
+
+	log_attach(LOG_PLAYBACK);
+	rt_attach(RT_PLAYBACK);
+
+	noise = malloc(pcm_frame_len * sizeof(*noise));
+	if (!noise)
+		err(1, "malloc");
+	cng_init(&cng);
+
+	/* Runs at the pace of the sink, ao_play() blocks
+	 * until the device has room */
+	do {
+		pthread_mutex_lock(&playback_state_lock);
+		if (state->quit) {
+			pthread_mutex_unlock(&playback_state_lock);
+			break;
+		}
+		pthread_mutex_unlock(&playback_state_lock);
+
+		waited = 0;
+		if (sem_trywait(&pcm_ready) < 0) {
+			/* The peer is silent, keep the sink going
+			 * with noise like its background */
+			cn = __atomic_load_n(&cn_params, __ATOMIC_ACQUIRE);
+			if (cn != cn_last) {
+				cng_set(&cng, (cn >> 8) & 0xff, cn & 0xff);
+				cn_last = cn;
+				cn_frames = 0;
+			}
+			/* Without updates the peer is gone */
+			if ((cn & CN_ACTIVE) &&
+			    cn_frames++ < 3 * CN_INTERVAL) {
+				cng_frame(&cng, noise, pcm_frame_len);
+				ao_play(device, (void *)noise,
+					pcm_frame_len * sizeof(*noise));
+				wakeup_add();
+				aec_playback(noise, pcm_frame_len);
+				stats.rx_cn_frames++;
+				continue;
+			}
+			/* The sink drained with nothing to play,
+			 * sleep until the decoder has a frame */
+			if (played && !(cn & CN_ACTIVE))
+				log_event(LOG_STARVING, 0, 0, 0);
+			played = 0;
+			waited = 1;
+			sem_sleep(&pcm_ready);
+			pthread_mutex_lock(&playback_state_lock);
+			if (state->quit) {
+				pthread_mutex_unlock(&playback_state_lock);
+				break;
+			}
+			pthread_mutex_unlock(&playback_state_lock);
+		}
+
+		frame = ring_peek(&pcm_ring);
+		/* Only the post main() makes at shutdown has no
+		 * frame behind it, whichever wait took it */
+		if (!frame)
+			break;
+		if (waited)
+			sched_lat_add(RT_PLAYBACK, now_ns() - frame->ready);
+
+		/* Play via libao */
+		ao_play(device, (void *)frame->pcm, frame->len);
+		wakeup_add();
+		played = 1;
+		aec_playback(frame->pcm, frame->len / 2);
+
+		ring_release(&pcm_ring);
+		sem_post(&pcm_free);
+	} while (1);
+
+	free(noise);
+
+	pthread_exit(NULL);
+
+	return NULL;
+}
+
+/* Decoder and resampler ready to go, from the pool or
+ * newly allocated if it ran dry */
+static void
+codec_get(OpusDecoder **dec, SpeexResamplerState **resampler)
+{
+	int error;
+
+	if (codec_pool.count) {
+		codec_pool.count--;
+		*dec = codec_pool.dec[codec_pool.count];
+		*resampler = codec_pool.resampler[codec_pool.count];
+		opus_decoder_ctl(*dec, OPUS_RESET_STATE);
+		speex_resampler_reset_mem(*resampler);
+		return;
+	}
+
+	*dec = opus_decoder_create(16000, fchan, &error);
+	if (error != OPUS_OK)
+		errx(1, "Cannot create opus decoder: %s",
+		     opus_strerror(error));
+	*resampler = speex_resampler_init(fchan, 16000, frate,
+					  SPEEX_RESAMPLER_QUALITY_DESKTOP,
+					  &error);
+	if (!*resampler)
+		errx(1, "Cannot create speex resampler");
+	codec_pool.allocated++;
+}
+
+/* Back to the pool, or freed if it is full */
+static void
+codec_put(OpusDecoder *dec, SpeexResamplerState *resampler)
+{
+	if (codec_pool.count < CODEC_POOL) {
+		codec_pool.dec[codec_pool.count] = dec;
+		codec_pool.resampler[codec_pool.count] = resampler;
+		codec_pool.count++;
+		return;
+	}
+	opus_decoder_destroy(dec);
+	speex_resampler_destroy(resampler);
+	codec_pool.allocated--;
+}
+
+/* Set the decoder complexity, counting it if the library
+ * does not take it: only libopus 1.5 and later have one */
+static void
+rx_codec_complexity(int complexity)
+{
+	if (opus_decoder_ctl(rx_codec.dec,
+			     OPUS_SET_COMPLEXITY(complexity)) != OPUS_OK)
+		stats.rx_shed_refused++;
+}
+
+/* Set up the decoder and the resampler after it, if
+ * they are not there yet or were released */
+static void
+rx_codec_wake(void)
+{
+	uint64_t start;
+
+	if (rx_codec.dec)
+		return;
+
+	start = now_ns();
+	codec_get(&rx_codec.dec, &rx_codec.resampler);
+	/* OPUS_RESET_STATE leaves the complexity alone, this
+	 * decoder may have been shed before it went back */
+	if (codec_pool.complexity >= 0)
+		rx_codec_complexity(shed_level >= SHED_COMPLEXITY ?
+				    0 : codec_pool.complexity);
+	hist_add(stats.rx_setup, now_ns() - start);
+}
+
+/* Hand the decoder and resampler back, the next
+ * talkspurt starts from a clean state anyway */
+static void
+rx_codec_sleep(void)
+{
+	if (!rx_codec.dec)
+		return;
+	codec_put(rx_codec.dec, rx_codec.resampler);
+	rx_codec.dec = NULL;
+	rx_codec.resampler = NULL;
+	stats.rx_hibernated++;
+}
+
+static int
+playback_quit(void)
+{
+	int quit;
+
+	pthread_mutex_lock(&playback_state_lock);
+	quit = playback_state.quit;
+	pthread_mutex_unlock(&playback_state_lock);
+	return quit;
+}
+
+/* Decode one frame into pcm_ring.  With no @data this
+ * conceals a lost frame, with @fec it is recovered from
+ * the redundancy in the packet that follows it.  Returns
+ * -1 when it is time to quit. */
+static int
+decode_frame(const unsigned char *data, size_t len, int fec)
+{
+	struct pcm_frame *frame;
+	opus_int16 pcm[FRAME_SIZE];
+	spx_uint32_t inlen;
+	spx_uint32_t outlen;
+	uint64_t start;
+	int ret;
+
+	/* Wait for room, this bounds the lookahead.  At exit
+	 * the wake-up comes without a slot, the output thread
+	 * may have quit holding all of them. */
+	sem_sleep(&pcm_free);
+	if (playback_quit())
+		return -1;
+	frame = ring_slot(&pcm_ring);
+	if (!frame)
+		return -1;
+
+	rx_codec_wake();
+	start = now_ns();
+
+	/* Decode compressed buffer */
+	ret = opus_decode(rx_codec.dec, data, len, pcm, FRAME_SIZE, fec);
+	if (ret < 0) {
+		log_event(LOG_DECODE_FAIL, ret, 0, 0);
+		/* Play silence if the decode failed */
+		memset(frame->pcm, 0, pcm_frame_len * 2);
+		frame->len = pcm_frame_len * 2;
+	} else {
+		/* Sample convert the RX path, lengths
+		 * are in samples */
+		inlen = ret;
+		outlen = pcm_frame_max;
+		speex_resampler_process_int(rx_codec.resampler,
+					    0, pcm, &inlen,
+					    frame->pcm, &outlen);
+		frame->len = outlen * 2;
+	}
+	frame->ready = now_ns();
+	latency_add(&stats.rx_decode, frame->ready - start);
+	hist_add(stats.rx_decode_hist, frame->ready - start);
+	ring_publish(&pcm_ring);
+	sem_post(&pcm_ready);
+	return 0;
+}
+
+/* Next packet to decode, NULL while prebuffering.  Comfort
+ * noise goes through at once, the prebuffer is for media.
+ * Called with compressed_buf_lock held. */
+static struct compressed_buf *
+decoder_next(int playing, int jb_target)
+{
+	struct compressed_buf *cbuf;
+
+	if (list_empty(&compressed_buf.list))
+		return NULL;
+	cbuf = list_first_entry(&compressed_buf.list,
+				struct compressed_buf, list);
+	if (cbuf->type != PKT_CN && !playing &&
+	    compressed_buf_len < jb_target)
+		return NULL;
+	return cbuf;
+}
+
+/* Count a packet the decode thread took, @late if it
+ * missed its deadline, and shed load or take it back on
+ * at the end of each window */
+static void
+shed_update(int late)
+{
+	unsigned int misses;
+	int level;
+
+	rx_shed.frames++;
+	rx_shed.misses += late;
+	if (rx_shed.frames < GOV_WINDOW)
+		return;
+
+	misses = rx_shed.misses;
+	rx_shed.frames = 0;
+	rx_shed.misses = 0;
+	level = shed_level;
+	if (misses >= SHED_MISSES) {
+		rx_shed.calm = 0;
+		if (level < SHED_DROP) {
+			level++;
+			stats.rx_shed_raised++;
+		}
+	} else if (misses) {
+		rx_shed.calm = 0;
+	} else if (++rx_shed.calm >= SHED_CALM && level > SHED_NONE) {
+		rx_shed.calm = 0;
+		level--;
+	}
+	if (level == shed_level)
+		return;
+
+	__atomic_store_n(&shed_level, level, __ATOMIC_RELAXED);
+	if (rx_codec.dec && codec_pool.complexity >= 0)
+		rx_codec_complexity(level >= SHED_COMPLEXITY ?
+				    0 : codec_pool.complexity);
+	stats.rx_shed_level = level;
+}
+
+/* Decode packets into pcm_ring, at most PCM_LOOKAHEAD
+ * frames ahead of the sink */
+static void *
+decoder(void *data)
+{
+	struct compressed_buf *cbuf;
+	struct playback_state *state = data;
+	struct comfort_noise *cn;
+	struct ctl_cmd cmd;
+	/* Packets to queue up before playing after an underrun
+	 * or at the start of a talkspurt */
+	int jb_target = 0;
+	int playing = 0;
+	/* The peer sent comfort noise, it is not talking */
+	int silent = 0;
+	uint32_t cn_count = 0;
+	uint32_t next_seq = 0, gap;
+	int have_seq = 0;
+	uint64_t start, delay;
+	int late, quit = 0;
+
+	log_attach(LOG_DECODE);
+	rt_attach(RT_DECODE);
+
+	do {
+		while (!ring_pop(&ctl_rings[CTL_DECODE], &cmd)) {
+			switch (cmd.op) {
+			case CTL_JITTER:
+				jb_target = cmd.value;
+				break;
+			case CTL_HIBERNATE:
+				/* Long enough without speech, give
+				 * the codec state back */
+				rx_codec_sleep();
+				break;
+			}
+		}
+
+		pthread_mutex_lock(&compressed_buf_lock);
+		if (!decoder_next(playing, jb_target)) {
+			/* Sleep until a packet comes in, it is time
+			 * to quit or to release the codec, the output
+			 * thread tells starving apart from silence */
+			start = now_ns();
+			pthread_cond_wait(&tx_pcm_cond, &compressed_buf_lock);
+			wakeup_add();
+			if (compressed_buf_signalled > start)
+				sched_lat_add(RT_DECODE, now_ns() -
+					      compressed_buf_signalled);
+			/* Nothing came in for more than two frames,
+			 * build the queue up again before playing */
+			if (now_ns() - start > 2 * 20000000ULL)
+				playing = 0;
+		}
+
+		pthread_mutex_lock(&playback_state_lock);
+		if (state->quit) {
+			pthread_mutex_unlock(&playback_state_lock);
+			pthread_mutex_unlock(&compressed_buf_lock);
+			break;
+		}
+		pthread_mutex_unlock(&playback_state_lock);
+
+		cbuf = decoder_next(playing, jb_target);
+		if (!cbuf) {
+			pthread_mutex_unlock(&compressed_buf_lock);
+			continue;
+		}
+
+		/* Only hold the lock to take the packet off */
+		list_del(&cbuf->list);
+		__atomic_store_n(&compressed_buf_len, compressed_buf_len - 1,
+				 __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&compressed_buf_lock);
+
+		/* Waiting out the jitter target is on purpose,
+		 * beyond that the decoder is falling behind */
+		delay = now_ns() - cbuf->queued;
+		latency_add(&stats.rx_queue_delay, delay);
+		late = delay > jb_target * FRAME_NS +
+			SHED_DELAY * 1000000ULL;
+		shed_update(late);
+		stats.rx_late += late;
+
+		gap = have_seq ? cbuf->seq - next_seq : 0;
+		/* Late or duplicate */
+		if ((int32_t)gap < 0)
+			goto next;
+		next_seq = cbuf->seq + 1;
+		have_seq = 1;
+
+		if (cbuf->type == PKT_CN) {
+			/* The playback thread takes over until the
+			 * next talkspurt, which gets prebuffered
+			 * again so the delay can settle anew */
+			cn = (struct comfort_noise *)cbuf->buf;
+			cn_count++;
+			__atomic_store_n(&cn_params, CN_ACTIVE |
+					 (cn_count & 0xff) << 16 |
+					 cn->level << 8 | cn->tilt,
+					 __ATOMIC_RELEASE);
+			silent = 1;
+			playing = 0;
+			goto next;
+		}
+		playing = 1;
+
+		/* Catch up rather than play it late */
+		if (late && shed_level >= SHED_DROP) {
+			stats.rx_shed_drops++;
+			goto next;
+		}
+
+		if (!silent && gap && shed_level >= SHED_CONCEAL) {
+			stats.rx_shed_conceal += gap < PLC_MAX ? gap : PLC_MAX;
+			gap = 0;
+		}
+
+		/* Cover for lost packets in the middle of a
+		 * talkspurt, the last one may be in this
+		 * packet's FEC data */
+		if (!silent && gap) {
+			if (gap > PLC_MAX)
+				gap = PLC_MAX;
+			while (gap-- > 1) {
+				if (decode_frame(NULL, 0, 0) < 0) {
+					quit = 1;
+					goto next;
+				}
+				stats.rx_plc++;
+			}
+			if (decode_frame(cbuf->buf, cbuf->len, 1) < 0) {
+				quit = 1;
+				goto next;
+			}
+			stats.rx_fec++;
+		}
+
+		if (decode_frame(cbuf->buf, cbuf->len, 0) < 0) {
+			quit = 1;
+			goto next;
+		}
+
+		/* Speech is queued, the noise can stop */
+		if (silent) {
+			__atomic_store_n(&cn_params, 0, __ATOMIC_RELEASE);
+			silent = 0;
+		}
+next:
+		free(cbuf->buf);
+		free(cbuf);
+	} while (!quit);
+
+	pthread_exit(NULL);
+
+	return NULL;
+}
+
+static void
+enqueue_for_playback(struct compressed_buf *cbuf)
+{
+	pthread_mutex_lock(&compressed_buf_lock);
+	list_add_tail(&cbuf->list, &compressed_buf.list);
+	__atomic_store_n(&compressed_buf_len, compressed_buf_len + 1,
+			 __ATOMIC_RELAXED);
+	compressed_buf_signalled = now_ns();
+	cbuf->queued = compressed_buf_signalled;
+	pthread_cond_signal(&tx_pcm_cond);
+	pthread_mutex_unlock(&compressed_buf_lock);
+}
+
+/* Update the loss and jitter estimates with a packet
+ * that arrived at @arrival (ns since the epoch).  Jitter
+ * is computed as in RFC 3550. */
+static void
+update_rx_stats(const struct compressed_header *hdr, size_t len,
+		uint64_t arrival)
+{
+	uint32_t timestamp, seq;
+	int32_t gap;
+	int64_t transit, d;
+
+	timestamp = ntohl(hdr->timestamp);
+	seq = ntohl(hdr->seq);
+
+	stats.rx_packets++;
+	stats.rx_bytes += len;
+
+	/* Arrival time in samples, only differences matter */
+	transit = (int64_t)(arrival / (1000000000ULL / 16000)) - timestamp;
+
+	if (rx_clock.valid) {
+		gap = (int32_t)(seq - rx_clock.expected);
+		/* Late or duplicate packets do not count as loss,
+		 * nor do they move the expected sequence back */
+		if (gap < 0)
+			return;
+		stats.rx_lost += gap;
+
+		d = transit - rx_clock.transit;
+		if (d < 0)
+			d = -d;
+		stats.rx_jitter += d - ((stats.rx_jitter + 8) >> 4);
+	}
+
+	rx_clock.valid = 1;
+	rx_clock.expected = seq + 1;
+	rx_clock.transit = transit;
+}
+
+/* Hand a new TX key over to the capture thread */
+static void
+install_tx_key(const struct crypto_key *key)
+{
+	pthread_mutex_lock(&capture_state_lock);
+	capture_state.tx_key = *key;
+	capture_state.tx_key_gen++;
+	pthread_mutex_unlock(&capture_state_lock);
+}
+
+static void
+load_ticket(struct ticket *t)
+{
+	uint8_t buf[sizeof(t->id) + sizeof(t->secret)];
+	ssize_t len;
+	int fd;
+
+	fd = open(fticketfile, O_RDONLY);
+	if (fd < 0)
+		return;
+	len = read(fd, buf, sizeof(buf));
+	close(fd);
+	if (len != sizeof(buf))
+		return;
+
+	memcpy(t->id, buf, sizeof(t->id));
+	memcpy(t->secret, buf + sizeof(t->id), sizeof(t->secret));
+	t->valid = 1;
+	memset(buf, 0, sizeof(buf));
+}
+
+static void
+save_ticket(const struct ticket *t)
+{
+	uint8_t buf[sizeof(t->id) + sizeof(t->secret)];
+	int fd;
+
+	fd = open(fticketfile, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		warn("open %s", fticketfile);
+		return;
+	}
+	memcpy(buf, t->id, sizeof(t->id));
+	memcpy(buf + sizeof(t->id), t->secret, sizeof(t->secret));
+	if (write(fd, buf, sizeof(buf)) != sizeof(buf))
+		warn("write %s", fticketfile);
+	close(fd);
+	memset(buf, 0, sizeof(buf));
+}
+
+/* Replace the ticket with one derived from @secret and
+ * @info, both ends get the same one */
+static void
+next_ticket(const uint8_t *secret, size_t len,
+	    const void *info, size_t infolen)
+{
+	struct ticket *t = &handshake.ticket;
+	uint8_t out[sizeof(t->id) + sizeof(t->secret)];
+
+	crypto_hkdf(NULL, 0, secret, len, info, infolen, out, sizeof(out));
+	memcpy(t->id, out, sizeof(t->id));
+	memcpy(t->secret, out + sizeof(t->id), sizeof(t->secret));
+	t->valid = 1;
+	memset(out, 0, sizeof(out));
+
+	if (fticketfile)
+		save_ticket(t);
+}
+
+/* Derive the key @random/@key contributes to, the sender
+ * of that random/key encrypts with it */
+static void
+session_key(const uint8_t *contrib, size_t len, struct crypto_key *key)
+{
+	uint8_t info[sizeof("sscall media") - 1 + CRYPTO_DH_LEN];
+	const uint8_t *secret;
+	size_t secretlen;
+
+	memcpy(info, "sscall media", sizeof("sscall media") - 1);
+	memcpy(info + sizeof("sscall media") - 1, contrib, len);
+
+	if (handshake.resume) {
+		secret = handshake.session.secret;
+		secretlen = sizeof(handshake.session.secret);
+	} else {
+		secret = handshake.master;
+		secretlen = sizeof(handshake.master);
+	}
+	crypto_derive(secret, secretlen, info,
+		      sizeof("sscall media") - 1 + len, key);
+}
+
+static void
+send_hello(void)
+{
+	unsigned char buf[sizeof(struct compressed_header) +
+			  sizeof(struct hello)];
+	struct compressed_header *hdr;
+	struct hello *h;
+	const uint8_t *mackey;
+	size_t mackeylen;
+	uint8_t zero[CRYPTO_KEY_LEN];
+	ssize_t ret;
+
+	memset(buf, 0, sizeof(buf));
+	hdr = (struct compressed_header *)buf;
+	hdr->sig = htonl(PKT_SIG);
+	hdr->version = PKT_VERSION;
+	hdr->type = PKT_HELLO;
+	hdr->ssrc = htonl(tx_ssrc);
+
+	h = (struct hello *)(buf + sizeof(*hdr));
+	memcpy(h->random, handshake.random, sizeof(h->random));
+	if (handshake.have_peer)
+		memcpy(h->echo, handshake.peer_random, sizeof(h->echo));
+	if (handshake.peer_has_us)
+		h->flags |= HELLO_ACKED;
+	if (handshake.resume) {
+		h->flags |= HELLO_RESUME;
+		memcpy(h->key, handshake.session.id,
+		       sizeof(handshake.session.id));
+		mackey = handshake.session.secret;
+		mackeylen = sizeof(handshake.session.secret);
+	} else {
+		memcpy(h->key, handshake.pub, sizeof(h->key));
+		/* Without a pre-shared key the exchange is
+		 * not authenticated, the MAC is a checksum */
+		memset(zero, 0, sizeof(zero));
+		mackey = handshake.have_psk ? handshake.psk : zero;
+		mackeylen = CRYPTO_KEY_LEN;
+	}
+	crypto_hmac(mackey, mackeylen, buf, sizeof(buf) - sizeof(h->mac),
+		    h->mac);
+
+	ret = sendto(capture_priv.sockfd, buf, sizeof(buf), 0,
+		     capture_priv.servinfo->ai_addr,
+		     capture_priv.servinfo->ai_addrlen);
+	if (ret < 0)
+		log_event(LOG_SEND_FAIL, 0, 0, 0);
+	handshake.last_sent = now_ns();
+	/* Again if the peer does not answer */
+	if (!handshake.done)
+		timer_mod(&timers, &hello_timer,
+			  handshake.last_sent / 1000000 + HELLO_INTERVAL);
+}
+
+/* Start a new session, resuming from the ticket if we
+ * have one.  When resuming our TX key only depends on
+ * our own random, so media can flow right away. */
+static void
+start_handshake(int resume)
+{
+	struct crypto_key key;
+
+	handshake.done = 0;
+	handshake.have_peer = 0;
+	handshake.peer_has_us = 0;
+	handshake.resume = resume && handshake.ticket.valid;
+	crypto_random(handshake.random, sizeof(handshake.random));
+
+	if (handshake.resume) {
+		handshake.session = handshake.ticket;
+		session_key(handshake.random, sizeof(handshake.random), &key);
+		install_tx_key(&key);
+		memset(&key, 0, sizeof(key));
+	} else {
+		crypto_keygen(handshake.priv, handshake.pub);
+	}
+
+	handshake.start = now_ns();
+	send_hello();
+}
+
+/* Both sides know each other's hello */
+static void
+finish_handshake(void)
+{
+	uint8_t info[sizeof("sscall ticket") - 1 + 32];
+	const uint8_t *a, *b;
+
+	handshake.done = 1;
+	timer_del(&timers, &hello_timer);
+	stats.hs_count++;
+	if (handshake.resume)
+		stats.hs_resumed++;
+	stats.hs_usec = (now_ns() - handshake.start) / 1000;
+	log_event(LOG_HANDSHAKE, handshake.resume, stats.hs_usec, 0);
+
+	/* Rotate the ticket so each one is used only once,
+	 * mixing in both randoms in a fixed order */
+	memcpy(info, "sscall ticket", sizeof("sscall ticket") - 1);
+	a = handshake.random;
+	b = handshake.peer_random;
+	if (memcmp(a, b, 16) > 0)
+		swap(a, b);
+	memcpy(info + sizeof("sscall ticket") - 1, a, 16);
+	memcpy(info + sizeof("sscall ticket") - 1 + 16, b, 16);
+	if (handshake.resume)
+		next_ticket(handshake.session.secret,
+			    sizeof(handshake.session.secret), info,
+			    sizeof(info));
+	else
+		next_ticket(handshake.master, sizeof(handshake.master),
+			    info, sizeof(info));
+}
+
+static void
+process_hello(const void *buf, size_t len)
+{
+	const struct compressed_header *hdr = buf;
+	const struct hello *h;
+	const struct ticket *t;
+	uint8_t mac[CRYPTO_MAC_LEN], shared[CRYPTO_DH_LEN];
+	uint8_t zero[CRYPTO_KEY_LEN];
+	struct crypto_key key;
+	int resume, fresh;
+	uint64_t now;
+
+	if (!crypto_enabled)
+		return;
+	h = (const struct hello *)((const unsigned char *)buf + sizeof(*hdr));
+	resume = h->flags & HELLO_RESUME;
+
+	if (resume) {
+		/* Either the ticket of this session, or the peer
+		 * restarted and resumes from the next one */
+		t = NULL;
+		if (handshake.resume &&
+		    !memcmp(h->key, handshake.session.id,
+			    sizeof(handshake.session.id)))
+			t = &handshake.session;
+		else if (handshake.ticket.valid &&
+			 !memcmp(h->key, handshake.ticket.id,
+				 sizeof(handshake.ticket.id)))
+			t = &handshake.ticket;
+
+		/* Unknown ticket, we cannot authenticate this.
+		 * Fall back to a full handshake, or if we are
+		 * done let our hello tell the peer to do so. */
+		if (!t) {
+			if (handshake.done)
+				send_hello();
+			else if (handshake.resume)
+				start_handshake(0);
+			return;
+		}
+		crypto_hmac(t->secret, sizeof(t->secret), buf,
+			    len - sizeof(h->mac), mac);
+	} else {
+		memset(zero, 0, sizeof(zero));
+		crypto_hmac(handshake.have_psk ? handshake.psk : zero,
+			    CRYPTO_KEY_LEN, buf, len - sizeof(h->mac), mac);
+	}
+	if (crypto_memcmp(mac, h->mac, sizeof(mac))) {
+		stats.rx_reject[REJECT_AUTH]++;
+		return;
+	}
+
+	fresh = !handshake.have_peer ||
+		memcmp(h->random, handshake.peer_random, sizeof(h->random));
+
+	/* An old hello replayed carries a valid MAC, and
+	 * without a pre-shared key anyone can make one, so a
+	 * running session only gives way to a new random once
+	 * the peer's media stopped, as it does when the peer
+	 * restarts, and not too often */
+	if (fresh && handshake.done) {
+		now = now_ns();
+		if (now - handshake.last_rx < PEER_QUIET * 1000000ULL ||
+		    now - handshake.start < RESTART_HOLDOFF * 1000000ULL) {
+			stats.hs_refused++;
+			return;
+		}
+	}
+
+	/* The peer restarted or switched modes, so do we */
+	if (fresh && handshake.have_peer)
+		start_handshake(resume);
+	else if (!resume && handshake.resume)
+		start_handshake(0);
+	else if (resume && !handshake.resume)
+		start_handshake(1);
+
+	if (fresh) {
+		memcpy(handshake.peer_random, h->random,
+		       sizeof(handshake.peer_random));
+		handshake.have_peer = 1;
+
+		if (resume) {
+			session_key(h->random, sizeof(h->random), &key);
+			crypto_init(&rx_crypto, &key, 0);
+		} else {
+			if (crypto_dh(handshake.priv, h->key, shared) < 0) {
+				handshake.have_peer = 0;
+				stats.rx_reject[REJECT_AUTH]++;
+				return;
+			}
+			crypto_hkdf(handshake.psk,
+				    handshake.have_psk ? sizeof(handshake.psk) : 0,
+				    shared, sizeof(shared), "sscall master",
+				    sizeof("sscall master") - 1,
+				    handshake.master, sizeof(handshake.master));
+			memset(shared, 0, sizeof(shared));
+			session_key(handshake.pub, sizeof(handshake.pub), &key);
+			install_tx_key(&key);
+			session_key(h->key, sizeof(h->key), &key);
+			crypto_init(&rx_crypto, &key, 0);
+		}
+		memset(&key, 0, sizeof(key));
+	}
+
+	if (!memcmp(h->echo, handshake.random, sizeof(h->echo)))
+		handshake.peer_has_us = 1;
+
+	/* Answer unless the peer already has all it needs */
+	if (fresh || !handshake.peer_has_us || !(h->flags & HELLO_ACKED))
+		send_hello();
+
+	if (!handshake.done && handshake.peer_has_us)
+		finish_handshake();
+}
+
+/* No answer to our hello, send it again until the
+ * peer has it */
+static void
+hello_expired(struct timer *t)
+{
+	(void)t;
+	if (crypto_enabled && !handshake.done)
+		send_hello();
+}
+
+/* Rate limiter bucket, kept as the theoretical arrival
+ * time of the next packet (GCRA), which behaves like a
+ * token bucket without having to refill it */
+struct rate_bucket {
+	uint64_t tat;
+};
+
+static struct rate_bucket rate_table[RATE_BUCKETS];
+
+/* Peer address as given on the command line */
+static struct sockaddr_in peer_addr;
+
+static int
+rate_limit(const struct sockaddr_in *sin, uint64_t now)
+{
+	struct rate_bucket *b;
+	uint32_t h;
+	const uint64_t interval = 1000000000ULL / RATE_PPS;
+
+	/* Sources that hash to the same bucket share it */
+	h = ntohl(sin->sin_addr.s_addr) * 2654435761U;
+	b = &rate_table[h >> 24 & (RATE_BUCKETS - 1)];
+
+	if (b->tat < now)
+		b->tat = now;
+	if (b->tat - now > RATE_BURST * interval)
+		return -1;
+	b->tat += interval;
+	return 0;
+}
+
+/* Cheap checks on a freshly received packet, done before
+ * anything is allocated or decrypted for it.  Returns
+ * the reason to drop it, or -1 to let it through. */
+static int
+ingress_filter(const void *buf, size_t len,
+	       const struct sockaddr_storage *addr, uint64_t now)
+{
+	const struct compressed_header *hdr = buf;
+	const struct sockaddr_in *sin = (const struct sockaddr_in *)addr;
+	size_t payload_len;
+
+	if (addr->ss_family != AF_INET)
+		return REJECT_SOURCE;
+	if (!fanysrc &&
+	    sin->sin_addr.s_addr != peer_addr.sin_addr.s_addr)
+		return REJECT_SOURCE;
+	if (rate_limit(sin, now) < 0)
+		return REJECT_RATE;
+
+	if (len < sizeof(*hdr))
+		return REJECT_SHORT;
+	if (ntohl(hdr->sig) != PKT_SIG)
+		return REJECT_SIG;
+	if (hdr->version != PKT_VERSION)
+		return REJECT_VERSION;
+
+	payload_len = len - sizeof(*hdr);
+	switch (hdr->type) {
+	case PKT_MEDIA:
+		if (hdr->cipher != CIPHER_NONE) {
+			if (payload_len <= CRYPTO_TAG_LEN)
+				return REJECT_LENGTH;
+			payload_len -= CRYPTO_TAG_LEN;
+		}
+		if (!payload_len || payload_len > MAX_OPUS_PACKET)
+			return REJECT_LENGTH;
+		break;
+	case PKT_HELLO:
+		if (payload_len != sizeof(struct hello))
+			return REJECT_LENGTH;
+		break;
+	case PKT_CN:
+		if (hdr->cipher != CIPHER_NONE)
+			payload_len -= CRYPTO_TAG_LEN;
+		if (payload_len != sizeof(struct comfort_noise))
+			return REJECT_LENGTH;
+		break;
+	default:
+		return REJECT_TYPE;
+	}
+
+	return -1;
+}
+
+/* Buffer of finished Ogg pages on its way to disk */
+struct rec_buf {
+	unsigned char *data;
+	size_t len;
+};
+
+/* Recording with -w, the received packets go into the
+ * file as they are, nothing is decoded.  The main thread
+ * muxes them into buffers the writer thread writes out
+ * whole, so the main thread never waits on the disk. */
+struct recorder {
+	int fd;
+	struct ogg_stream ogg;
+	struct rec_buf bufs[REC_BUFS];
+	/* Buffer being filled, NULL if the writer has
+	 * them all */
+	struct rec_buf *cur;
+	/* Buffers to write, main to writer thread, and
+	 * written ones back */
+	struct ring full;
+	struct ring free;
+	sem_t ready;
+	int quit;
+	/* Stream being recorded, its next timestamp and
+	 * the TOC byte of its last packet */
+	int started;
+	uint32_t ssrc;
+	uint32_t next_ts;
+	uint8_t toc;
+	struct timer flush_timer;
+} recorder;
+
+/* Writer thread */
+static pthread_t record_thread;
+
+/* Hand the buffer being filled to the writer and
+ * take a free one */
+static void
+rec_handover(void)
+{
+	struct rec_buf *b = recorder.cur;
+
+	if (b && b->len) {
+		/* There are only REC_BUFS buffers, so the
+		 * full ring always has room */
+		ring_push(&recorder.full, &b);
+		sem_post(&recorder.ready);
+		b = NULL;
+	}
+	if (!b && ring_pop(&recorder.free, &b) < 0)
+		b = NULL;
+	recorder.cur = b;
+}
+
+/* Finish the page and put it in a buffer */
+static void
+rec_page(int eos)
+{
+	struct rec_buf *b;
+
+	b = recorder.cur;
+	if (!b || b->len + ogg_page_size(&recorder.ogg) > REC_BUF_SIZE) {
+		rec_handover();
+		b = recorder.cur;
+	}
+	/* The disk is behind, lose the page */
+	if (!b) {
+		ogg_discard(&recorder.ogg);
+		stats.rec_dropped++;
+		return;
+	}
+	b->len += ogg_flush(&recorder.ogg, b->data + b->len, eos);
+}
+
+/* Add a packet of @samples at 48 kHz to the stream.  A
+ * full page is only finished when the next packet comes,
+ * so the last page always has packets on it to carry the
+ * end of stream. */
+static void
+rec_add(const unsigned char *data, size_t len, int samples)
+{
+	uint64_t granule;
+
+	if (recorder.ogg.packets >= REC_PAGE_FRAMES)
+		rec_page(0);
+	granule = recorder.ogg.granule + samples;
+	if (ogg_packet(&recorder.ogg, data, len, granule) < 0) {
+		rec_page(0);
+		ogg_packet(&recorder.ogg, data, len, granule);
+	}
+}
+
+/* Mark the frames from the next one expected up to @ts
+ * as lost, returns -1 if @ts is from before that */
+static int
+rec_fill(uint32_t ts)
+{
+	uint32_t span, gap;
+	uint8_t lost;
+	int n;
+
+	/* Late or duplicate, its place is taken */
+	if ((int32_t)(ts - recorder.next_ts) < 0) {
+		stats.rec_late++;
+		return -1;
+	}
+	span = ts - recorder.next_ts;
+	if (span > REC_GAP_MAX * FRAME_SIZE) {
+		stats.rec_resync++;
+		span = 0;
+	}
+	/* Code 0 packet, same mode, bandwidth and frame
+	 * size as the last one */
+	lost = recorder.toc & 0xfc;
+	n = opus_packet_get_nb_samples(&lost, 1, 48000);
+	for (gap = span / (n / 3); gap; gap--) {
+		rec_add(&lost, 1, n);
+		stats.rec_plc++;
+	}
+	return 0;
+}
+
+/* Write a received packet to the recording.  Lost frames
+ * become packets with a single empty frame, which Opus
+ * decoders conceal, so the recording keeps time. */
+static void
+record_packet(const struct compressed_header *hdr,
+	      const unsigned char *payload, size_t len)
+{
+	uint32_t ts, ssrc;
+	int n;
+
+	ts = ntohl(hdr->timestamp);
+	ssrc = ntohl(hdr->ssrc);
+
+	/* Comfort noise is not Opus, the silence up to and
+	 * including its frame is marked as lost as it goes,
+	 * however long the peer stays quiet */
+	if (hdr->type == PKT_CN) {
+		if (recorder.started && ssrc == recorder.ssrc &&
+		    !rec_fill(ts + FRAME_SIZE))
+			recorder.next_ts = ts + FRAME_SIZE;
+		return;
+	}
+	if (!len)
+		return;
+	/* -f may send packets shorter than a frame */
+	n = opus_packet_get_nb_samples(payload, len, 48000);
+	if (n <= 0)
+		return;
+
+	if (!recorder.started || ssrc != recorder.ssrc) {
+		recorder.started = 1;
+		recorder.ssrc = ssrc;
+		recorder.next_ts = ts;
+	}
+
+	if (rec_fill(ts) < 0)
+		return;
+	rec_add(payload, len, n);
+	recorder.toc = payload[0];
+	/* 48 kHz to the network rate */
+	recorder.next_ts = ts + n / 3;
+	stats.rec_packets++;
+}
+
+/* Pages finished so far go to disk now and then, even
+ * if the buffer has room left */
+static void
+rec_flush_expired(struct timer *t)
+{
+	rec_handover();
+	timer_mod(&timers, t, timers.now + REC_FLUSH);
+}
+
+/* Writer thread, writes full buffers out and hands
+ * them back */
+static void *
+recorder_writer(void *data)
+{
+	struct recorder *rec = data;
+	struct rec_buf *b;
+	size_t off;
+	ssize_t ret;
+	int quit;
+
+	do {
+		while (sem_wait(&rec->ready) < 0 && errno == EINTR)
+			;
+		quit = __atomic_load_n(&rec->quit, __ATOMIC_ACQUIRE);
+
+		while (!ring_pop(&rec->full, &b)) {
+			for (off = 0; off < b->len; off += ret) {
+				ret = write(rec->fd, b->data + off,
+					    b->len - off);
+				if (ret < 0 && errno == EINTR) {
+					ret = 0;
+					continue;
+				}
+				if (ret < 0) {
+					if (!stats.rec_errors)
+						warn("%s", frecord);
+					stats.rec_errors++;
+					break;
+				}
+				stats.rec_bytes += ret;
+			}
+			b->len = 0;
+			ring_push(&rec->free, &b);
+		}
+	} while (!quit);
+
+	pthread_exit(NULL);
+
+	return NULL;
+}
+
+static void
+init_record(void)
+{
+	uint8_t head[OGG_MAX_DATA];
+	uint32_t serial;
+	struct rec_buf *b;
+	size_t len;
+	int i, ret;
+
+	if (!frecord)
+		return;
+
+	recorder.fd = open(frecord, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (recorder.fd < 0)
+		err(1, "%s", frecord);
+
+	if (ring_init(&recorder.full, REC_BUFS, sizeof(b)) < 0 ||
+	    ring_init(&recorder.free, REC_BUFS, sizeof(b)) < 0)
+		err(1, "malloc");
+	for (i = 0; i < REC_BUFS; i++) {
+		b = &recorder.bufs[i];
+		ret = posix_memalign((void **)&b->data, REC_ALIGN,
+				     REC_BUF_SIZE);
+		if (ret) {
+			errno = ret;
+			err(1, "posix_memalign");
+		}
+		b->len = 0;
+		ring_push(&recorder.free, &b);
+	}
+	sem_init(&recorder.ready, 0, 0);
+	rec_handover();
+
+	/* The headers go on pages of their own */
+	crypto_random(&serial, sizeof(serial));
+	ogg_init(&recorder.ogg, serial);
+	len = opus_head(head, fchan, REC_PRESKIP, 16000);
+	ogg_packet(&recorder.ogg, head, len, 0);
+	rec_page(0);
+	len = opus_tags(head, sizeof(head), "sscall " VERSION);
+	ogg_packet(&recorder.ogg, head, len, 0);
+	rec_page(0);
+
+	timer_init(&recorder.flush_timer, rec_flush_expired);
+	timer_mod(&timers, &recorder.flush_timer, timers.now + REC_FLUSH);
+
+	ret = pthread_create(&record_thread, &thread_attr,
+			     recorder_writer, &recorder);
+	if (ret) {
+		errno = ret;
+		err(1, "pthread_create");
+	}
+}
+
+/* End the stream and wait for it to be on disk */
+static void
+deinit_record(void)
+{
+	int i;
+
+	if (!frecord)
+		return;
+
+	timer_del(&timers, &recorder.flush_timer);
+	/* The end of stream goes on the last page of audio,
+	 * a recording without any is left at the headers */
+	if (recorder.ogg.packets)
+		rec_page(1);
+	rec_handover();
+
+	__atomic_store_n(&recorder.quit, 1, __ATOMIC_RELEASE);
+	sem_post(&recorder.ready);
+	pthread_join(record_thread, NULL);
+
+	if (close(recorder.fd) < 0)
+		warn("%s", frecord);
+	for (i = 0; i < REC_BUFS; i++)
+		free(recorder.bufs[i].data);
+	ring_free(&recorder.full);
+	ring_free(&recorder.free);
+	sem_destroy(&recorder.ready);
+}
+
+/* Parse the compressed packet and enqueue it for
+ * playback */
+static void
+process_compressed_packet(void *buf, size_t len, uint64_t arrival)
+{
+	struct compressed_buf *cbuf;
+	struct compressed_header *hdr;
+	unsigned char *payload;
+	size_t payload_len;
+	uint64_t start;
+
+	/* The header has been checked by ingress_filter() */
+	hdr = (struct compressed_header *)buf;
+	if (hdr->type == PKT_HELLO) {
+		process_hello(buf, len);
+		return;
+	}
+
+	payload = (unsigned char *)buf + sizeof(*hdr);
+	payload_len = len - sizeof(*hdr);
+
+	/* Authenticate and decrypt in place, before
+	 * anything gets allocated for the packet.  A replayed
+	 * packet carries a valid tag, so the sequence number
+	 * is checked against those already seen first. */
+	if (crypto_enabled) {
+		if (crypto_replay_check(&rx_crypto, ntohl(hdr->seq)) < 0) {
+			stats.rx_reject[REJECT_REPLAY]++;
+			return;
+		}
+		start = now_ns();
+		if (hdr->cipher == CIPHER_NONE ||
+		    crypto_open(&rx_crypto, hdr->cipher, ntohl(hdr->ssrc),
+				ntohl(hdr->seq), hdr, sizeof(*hdr),
+				payload, payload_len) < 0) {
+			stats.rx_reject[REJECT_AUTH]++;
+			return;
+		}
+		crypto_replay_update(&rx_crypto, ntohl(hdr->seq));
+		handshake.last_rx = now_ns();
+		stats.rx_crypto_ns += handshake.last_rx - start;
+		payload_len -= CRYPTO_TAG_LEN;
+		/* Only our hello gives the peer this key */
+		if (!handshake.peer_has_us) {
+			handshake.peer_has_us = 1;
+			if (handshake.have_peer && !handshake.done)
+				finish_handshake();
+		}
+	} else if (hdr->cipher != CIPHER_NONE) {
+		stats.rx_reject[REJECT_AUTH]++;
+		return;
+	}
+
+	if (hdr->type == PKT_CN)
+		stats.rx_cn++;
+
+	if (frecord)
+		record_packet(hdr, payload, payload_len);
+
+	/* Before the queue is checked, so a packet we drop
+	 * does not show up as network loss */
+	update_rx_stats(hdr, len, arrival);
+
+	/* Never let a flood grow the playout queue, a stale
+	 * length read without the lock is good enough here */
+	if (__atomic_load_n(&compressed_buf_len, __ATOMIC_RELAXED) >=
+	    MAX_QUEUED) {
+		stats.rx_reject[REJECT_QUEUE]++;
+		return;
+	}
+
+	cbuf = malloc(sizeof(*cbuf));
+	if (!cbuf)
+		err(1, "malloc");
+	memset(cbuf, 0, sizeof(*cbuf));
+
+	cbuf->len = payload_len;
+	cbuf->buf = malloc(cbuf->len);
+	if (!cbuf->buf)
+		err(1, "malloc");
+
+	memcpy(cbuf->buf, payload, cbuf->len);
+	cbuf->type = hdr->type;
+	cbuf->seq = ntohl(hdr->seq);
+
+	enqueue_for_playback(cbuf);
+
+	/* Push the release of the decoder back, the wheel
+	 * makes that cheap enough for every packet */
+	if (fhibernate && hdr->type != PKT_CN)
+		timer_mod(&timers, &hibernate_timer,
+			  timers.now + fhibernate * 1000);
+}
+
+/* The peer has not talked for -H seconds, have the
+ * decode thread release its codec */
+static void
+hibernate_expired(struct timer *t)
+{
+	struct ctl_cmd cmd;
+
+	cmd.op = CTL_HIBERNATE;
+	cmd.value = 0;
+	/* Full of control commands, try again later */
+	if (ring_push(&ctl_rings[CTL_DECODE], &cmd) < 0) {
+		timer_mod(&timers, t, timers.now + 1000);
+		return;
+	}
+	pthread_mutex_lock(&compressed_buf_lock);
+	pthread_cond_signal(&tx_pcm_cond);
+	pthread_mutex_unlock(&compressed_buf_lock);
+}
+
+/* Work out when the frame starting at sample offset
+ * @pos should leave.  That is its capture time plus the
+ * pacing offset, so a burst read from the pipe leaves at
+ * the media rate.  A frame that is later than the offset
+ * can absorb restarts the schedule from now. */
+static uint64_t
+pacer_departure(uint64_t pos)
+{
+	int64_t now, mt, txtime;
+
+	now = now_ns();
+	mt = pos * (1000000000ULL / 16000);
+
+	if (!pacer_state.anchored) {
+		pacer_state.anchor = now - mt;
+		pacer_state.anchored = 1;
+	}
+
+	/* Slide towards early arrivals, slowly enough that a
+	 * burst is still spread out but a source that runs a
+	 * little fast does not build up a queue */
+	if (now - mt < pacer_state.anchor)
+		pacer_state.anchor -= (pacer_state.anchor - (now - mt)) / 64;
+
+	txtime = pacer_state.anchor + mt + fpace * 1000000LL;
+	if (txtime < now) {
+		pacer_state.anchor = now - mt - fpace * 1000000LL;
+		txtime = now;
+	}
+
+	return txtime;
+}
+
+/* Sleep until @txtime on CLOCK_MONOTONIC */
+static void
+pacer_sleep(int tfd, uint64_t txtime)
+{
+	struct timespec ts;
+
+	ts.tv_sec = txtime / 1000000000ULL;
+	ts.tv_nsec = txtime % 1000000000ULL;
+#ifdef __linux__
+	struct itimerspec its;
+	uint64_t expirations;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value = ts;
+	if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		err(1, "timerfd_settime");
+	while (read(tfd, &expirations, sizeof(expirations)) < 0 &&
+	       errno == EINTR)
+		;
+#else
+	(void)tfd;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+			       &ts, NULL) == EINTR)
+		;
+#endif
+}
+
+/* Pacer thread, sends queued packets at their departure
+ * time when the kernel cannot do it for us */
+static void *
+pacer(void *data)
+{
+	struct pacer_state *state = data;
+	struct paced_buf *pbuf;
+	struct list_head *iter, *q;
+	int tfd = -1;
+	ssize_t ret;
+	uint64_t now;
+	int ahead;
+
+	log_attach(LOG_PACER);
+	rt_attach(RT_PACER);
+
+#ifdef __linux__
+	tfd = timerfd_create(CLOCK_MONOTONIC, 0);
+	if (tfd < 0)
+		err(1, "timerfd_create");
+#endif
+
+	do {
+		pthread_mutex_lock(&paced_buf_lock);
+		while (list_empty(&paced_buf.list) && !state->quit) {
+			pthread_cond_wait(&paced_buf_cond, &paced_buf_lock);
+			wakeup_add();
+		}
+		if (state->quit) {
+			pthread_mutex_unlock(&paced_buf_lock);
+			break;
+		}
+		pbuf = list_entry(paced_buf.list.next, struct paced_buf,
+				  list);
+		list_del(&pbuf->list);
+		pthread_mutex_unlock(&paced_buf_lock);
+
+		ahead = now_ns() < pbuf->txtime;
+		pacer_sleep(tfd, pbuf->txtime);
+		now = now_ns();
+		if (ahead) {
+			wakeup_add();
+			if (now > pbuf->txtime)
+				sched_lat_add(RT_PACER, now - pbuf->txtime);
+		}
+
+		ret = sendto(capture_priv.sockfd, pbuf->buf, pbuf->len, 0,
+			     capture_priv.servinfo->ai_addr,
+			     capture_priv.servinfo->ai_addrlen);
+		if (ret < 0)
+			log_event(LOG_SEND_FAIL, 0, 0, 0);
+
+		free(pbuf->buf);
+		free(pbuf);
+	} while (1);
+
+	/* Drop whatever did not make it out */
+	list_for_each_safe(iter, q, &paced_buf.list) {
+		pbuf = list_entry(iter, struct paced_buf, list);
+		list_del(&pbuf->list);
+		free(pbuf->buf);
+		free(pbuf);
+	}
+
+	if (tfd >= 0)
+		close(tfd);
+
+	pthread_exit(NULL);
+
+	return NULL;
+}
+
+/* Hand a packet to the kernel with its departure time
+ * attached, the fq qdisc holds it back until then */
+static ssize_t
+send_txtime(const void *buf, size_t len, uint64_t txtime)
+{
+#ifdef SO_TXTIME
+	char control[CMSG_SPACE(sizeof(txtime))];
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cm;
+
+	iov.iov_base = (void *)buf;
+	iov.iov_len = len;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	msg.msg_name = capture_priv.servinfo->ai_addr;
+	msg.msg_namelen = capture_priv.servinfo->ai_addrlen;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_TXTIME;
+	cm->cmsg_len = CMSG_LEN(sizeof(txtime));
+	memcpy(CMSG_DATA(cm), &txtime, sizeof(txtime));
+
+	return sendmsg(capture_priv.sockfd, &msg, 0);
+#else
+	(void)buf;
+	(void)len;
+	(void)txtime;
+	errno = EOPNOTSUPP;
+	return -1;
+#endif
+}
+
+/* Send a packet out, paced if requested.  @pos is the
+ * sample offset of the frame in the capture stream. */
+static void
+send_packet(const void *buf, size_t len, uint64_t pos)
+{
+	struct paced_buf *pbuf;
+	uint64_t txtime;
+	ssize_t ret;
+
+	if (!fpace) {
+		ret = sendto(capture_priv.sockfd, buf, len, 0,
+			     capture_priv.servinfo->ai_addr,
+			     capture_priv.servinfo->ai_addrlen);
+		if (ret < 0)
+			log_event(LOG_SEND_FAIL, 0, 0, 0);
+		return;
+	}
+
+	txtime = pacer_departure(pos);
+
+	if (pacer_state.txtime) {
+		ret = send_txtime(buf, len, txtime);
+		if (ret < 0)
+			log_event(LOG_SEND_FAIL, 0, 0, 0);
+		return;
+	}
+
+	pbuf = malloc(sizeof(*pbuf));
+	if (!pbuf)
+		err(1, "malloc");
+	memset(pbuf, 0, sizeof(*pbuf));
+
+	pbuf->buf = malloc(len);
+	if (!pbuf->buf)
+		err(1, "malloc");
+	memcpy(pbuf->buf, buf, len);
+	pbuf->len = len;
+	pbuf->txtime = txtime;
+
+	pthread_mutex_lock(&paced_buf_lock);
+	list_add_tail(&pbuf->list, &paced_buf.list);
+	pthread_cond_signal(&paced_buf_cond);
+	pthread_mutex_unlock(&paced_buf_lock);
+}
+
+static void
+set_complexity(int complexity)
+{
+	tx_gov.complexity = complexity;
+	opus_encoder_ctl(opus_enc, OPUS_SET_COMPLEXITY(complexity));
+	stats.tx_complexity = complexity;
+}
+
+/* Trade quality for time when encoding gets close to
+ * the frame deadline, or the thread does not get to run
+ * because the host is busy, and back when there is room.
+ * Called by the encode stage after each frame. */
+static void
+governor(uint64_t cpu, uint64_t wall, int late)
+{
+	uint64_t avg_cpu, avg_wall;
+
+	tx_gov.frames++;
+	tx_gov.cpu_ns += cpu;
+	tx_gov.wall_ns += wall;
+	tx_gov.late += late;
+	if (tx_gov.frames < GOV_WINDOW)
+		return;
+
+	avg_cpu = tx_gov.cpu_ns / tx_gov.frames;
+	avg_wall = tx_gov.wall_ns / tx_gov.frames;
+	late = tx_gov.late;
+	tx_gov.frames = 0;
+	tx_gov.cpu_ns = 0;
+	tx_gov.wall_ns = 0;
+	tx_gov.late = 0;
+	if (tx_gov.pinned)
+		return;
+
+	/* Waiting for the CPU shows up as wall time that
+	 * was not spent encoding, a busy host when that is
+	 * more than the encoding itself */
+	if (late || avg_cpu > FRAME_NS * GOV_HIGH / 100 ||
+	    __atomic_load_n(&shed_level, __ATOMIC_RELAXED) >= SHED_COMPLEXITY ||
+	    (avg_wall > FRAME_NS * GOV_LOW / 100 &&
+	     avg_wall - avg_cpu > avg_cpu)) {
+		tx_gov.calm = 0;
+		if (tx_gov.complexity > 0) {
+			set_complexity(tx_gov.complexity - 1);
+			stats.tx_gov_down++;
+		}
+	} else if (avg_wall < FRAME_NS * GOV_LOW / 100) {
+		if (++tx_gov.calm >= GOV_CALM && tx_gov.complexity < 10) {
+			set_complexity(tx_gov.complexity + 1);
+			stats.tx_gov_up++;
+			tx_gov.calm = 0;
+		}
+	} else {
+		tx_gov.calm = 0;
+	}
+}
+
+/* Apply reconfiguration requests, called by the
+ * encode stage between two frames */
+static void
+capture_ctl(int *muted)
+{
+	struct ctl_cmd cmd;
+
+	while (!ring_pop(&ctl_rings[CTL_CAPTURE], &cmd)) {
+		switch (cmd.op) {
+		case CTL_BITRATE:
+			opus_encoder_ctl(opus_enc, OPUS_SET_BITRATE(cmd.value));
+			break;
+		case CTL_COMPLEXITY:
+			/* By hand it stays put, auto hands it
+			 * back to the governor */
+			tx_gov.pinned = cmd.value >= 0;
+			if (tx_gov.pinned)
+				set_complexity(cmd.value);
+			break;
+		case CTL_FEC:
+			/* The value is the expected loss in percent */
+			opus_encoder_ctl(opus_enc,
+					 OPUS_SET_INBAND_FEC(cmd.value > 0));
+			opus_encoder_ctl(opus_enc,
+					 OPUS_SET_PACKET_LOSS_PERC(cmd.value));
+			break;
+		case CTL_MUTE:
+			*muted = cmd.value;
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+static int
+capture_quit(void)
+{
+	int quit;
+
+	pthread_mutex_lock(&capture_state_lock);
+	quit = capture_state.quit;
+	pthread_mutex_unlock(&capture_state_lock);
+	return quit;
+}
+
+/* Producer side, wait for a free slot.  Returns NULL
+ * when it is time to quit. */
+static struct tx_frame *
+tx_get(struct tx_link *l)
+{
+	sem_sleep(&l->free);
+	if (capture_quit())
+		return NULL;
+	return ring_slot(&l->ring);
+}
+
+static void
+tx_put(struct tx_link *l)
+{
+	ring_publish(&l->ring);
+	sem_post(&l->ready);
+}
+
+/* Consumer side, wait for a frame.  Returns NULL
+ * when it is time to quit. */
+static struct tx_frame *
+tx_next(struct tx_link *l)
+{
+	sem_sleep(&l->ready);
+	if (capture_quit())
+		return NULL;
+	return ring_peek(&l->ring);
+}
+
+static void
+tx_done(struct tx_link *l)
+{
+	ring_release(&l->ring);
+	sem_post(&l->free);
+}
+
+/* Sleep until @due on CLOCK_MONOTONIC, a frame at a time
+ * so that a pause in the file does not hold up quitting.
+ * Returns -1 when it is time to quit. */
+static int
+capture_sleep(uint64_t due)
+{
+	struct timespec ts;
+	uint64_t now, until;
+
+	while ((now = now_ns()) < due) {
+		if (capture_quit())
+			return -1;
+		until = due - now > FRAME_NS ? now + FRAME_NS : due;
+		ts.tv_sec = until / 1000000000ULL;
+		ts.tv_nsec = until % 1000000000ULL;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+				       &ts, NULL) == EINTR)
+			;
+		wakeup_add();
+	}
+	return capture_quit() ? -1 : 0;
+}
+
+/* Nothing left to send, wait until it is time to quit */
+static void
+capture_idle(void)
+{
+	struct pollfd pfd;
+
+	while (!capture_quit()) {
+		pfd.fd = capture_priv.wake[0];
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			err(1, "poll");
+		wakeup_add();
+	}
+}
+
+/* Convert the next frame of the -i file into @pcm, which
+ * is padded with silence at the end.  Returns the samples
+ * that came from the file, 0 once it is all read. */
+static unsigned int
+input_frame(int16_t *pcm)
+{
+	struct pcm_format *fmt = &input_file.fmt;
+	size_t frames;
+
+	frames = (fmt->len - input_file.off) / pcm_frame_bytes(fmt);
+	if (frames > in_frame_len)
+		frames = in_frame_len;
+	pcm_to_s16(fmt, input_file.data + fmt->offset + input_file.off,
+		   frames, pcm);
+	memset(pcm + frames, 0, (in_frame_len - frames) * sizeof(*pcm));
+	input_file.off += frames * pcm_frame_bytes(fmt);
+	return frames;
+}
+
+/* Read a frame from the -i file into @f at the pace of
+ * its sample rate, returns -1 when it is time to quit */
+static int
+input_read(struct tx_frame *f)
+{
+	if (!input_file.start)
+		input_file.start = now_ns();
+	if (input_file.off == input_file.fmt.len) {
+		capture_idle();
+		return -1;
+	}
+	if (capture_sleep(input_file.start +
+			  input_file.frames * FRAME_NS) < 0)
+		return -1;
+
+	input_frame(f->pcm);
+	input_file.frames++;
+	f->read = now_ns();
+	f->len = in_frame_len;
+	return 0;
+}
+
+/* Read a whole frame of in_frame_len samples into @f,
+ * returns -1 when it is time to quit */
+static int
+capture_read(struct tx_frame *f)
+{
+	struct pollfd pfd[2];
+	size_t want, got;
+	ssize_t bytes;
+	int eof = 0;
+
+	if (finput)
+		return input_read(f);
+
+	want = in_frame_len * sizeof(f->pcm[0]);
+	got = 0;
+	while (got < want) {
+		bytes = read(capture_priv.fd, (char *)f->pcm + got,
+			     want - got);
+		if (bytes > 0) {
+			got += bytes;
+			continue;
+		}
+		if (bytes == 0)
+			eof = 1;
+		if (capture_quit())
+			return -1;
+		/* Sleep until there is something to read or it is
+		 * time to quit, at end of file only for the latter */
+		pfd[0].fd = capture_priv.wake[0];
+		pfd[0].events = POLLIN;
+		pfd[1].fd = capture_priv.fd;
+		pfd[1].events = POLLIN;
+		if (poll(pfd, eof ? 1 : 2, -1) < 0 && errno != EINTR)
+			err(1, "poll");
+		wakeup_add();
+	}
+	f->read = now_ns();
+	f->len = in_frame_len;
+	return 0;
+}
+
+/* DSP stage, take the echo of what the sink played out
+ * of the 16kHz frame @f.  One reference frame goes with
+ * each frame read, the one heard as it started. */
+static void
+aec_capture(struct tx_frame *f)
+{
+	spx_int16_t rec[FRAME_SIZE], play[FRAME_SIZE];
+	struct aec_ref *ref;
+	uint64_t start, cpu;
+	unsigned int len;
+
+	start = f->read - FRAME_NS;
+	/* Skip what is too old to line up, after a stall */
+	while ((ref = ring_peek(&aec_ring)) &&
+	       ref->played + 2 * FRAME_NS < start)
+		ring_release(&aec_ring);
+	if (ref && ref->played <= start) {
+		memcpy(play, ref->pcm, sizeof(play));
+		ring_release(&aec_ring);
+	} else {
+		/* The sink was idle */
+		memset(play, 0, sizeof(play));
+	}
+
+	len = f->len < FRAME_SIZE ? f->len : FRAME_SIZE;
+	memcpy(rec, f->pcm, len * sizeof(rec[0]));
+	memset(rec + len, 0, (FRAME_SIZE - len) * sizeof(rec[0]));
+
+	cpu = cpu_ns();
+	speex_echo_cancellation(speex_echo, rec, play, f->pcm);
+	latency_add(&stats.tx_aec, cpu_ns() - cpu);
+}
+
+/* DSP stage, suppress noise in the 16kHz frame @f
+ * and bring it to a steady level */
+static void
+preprocess_capture(struct tx_frame *f)
+{
+	uint64_t cpu;
+
+	/* The preprocessor works on whole frames, there
+	 * is room in f->pcm for that */
+	if (f->len < FRAME_SIZE)
+		memset(f->pcm + f->len, 0,
+		       (FRAME_SIZE - f->len) * sizeof(f->pcm[0]));
+
+	cpu = cpu_ns();
+	speex_preprocess_run(speex_preprocess, f->pcm);
+	latency_add(&stats.tx_preprocess, cpu_ns() - cpu);
+}
+
+/* DSP stage, bring the frame to 16kHz */
+static void
+capture_dsp(const struct tx_frame *in, struct tx_frame *out)
+{
+	spx_uint32_t inlen, outlen;
+
+	/* The encoder takes whole frames of FRAME_SIZE, a
+	 * short one is the resampler starting up */
+	inlen = in->len;
+	outlen = FRAME_SIZE;
+	speex_resampler_process_int(speex_resampler_tx, 0,
+				    in->pcm, &inlen, out->pcm, &outlen);
+	memset(out->pcm + outlen, 0,
+	       (FRAME_SIZE - outlen) * sizeof(out->pcm[0]));
+	out->len = FRAME_SIZE;
+	out->read = in->read;
+	out->pos = in->pos;
+
+	if (speex_echo)
+		aec_capture(out);
+	if (speex_preprocess)
+		preprocess_capture(out);
+
+	out->speech = 1;
+	if (fvad) {
+		out->speech = vad_frame(&tx_vad, out->pcm, out->len);
+		out->cn.level = vad_noise_level(&tx_vad);
+		out->cn.tilt = vad_noise_tilt(&tx_vad);
+	}
+}
+
+/* Put the header on the @len byte payload after it,
+ * encrypt and send */
+static void
+tx_send(struct tx_encoder *enc, int type, unsigned char *buf, size_t len,
+	uint64_t pos)
+{
+	struct compressed_header *hdr;
+	uint64_t start;
+
+	hdr = (struct compressed_header *)buf;
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->sig = htonl(PKT_SIG);
+	hdr->version = PKT_VERSION;
+	hdr->type = type;
+	hdr->ssrc = htonl(tx_ssrc);
+	hdr->seq = htonl(enc->seq);
+	hdr->timestamp = htonl(pos);
+
+	/* Nothing goes out before the handshake */
+	if (crypto_enabled && !enc->tx_key_gen) {
+		stats.tx_nokey++;
+		return;
+	}
+
+	/* Encrypt the payload in place */
+	if (crypto_enabled) {
+		start = now_ns();
+		hdr->cipher = tx_cipher;
+		if (crypto_seal(&tx_crypto, tx_cipher, tx_ssrc, enc->seq,
+				hdr, sizeof(*hdr), buf + sizeof(*hdr),
+				len) < 0)
+			errx(1, "Failed to encrypt packet");
+		len += CRYPTO_TAG_LEN;
+		stats.tx_crypto_ns += now_ns() - start;
+	}
+	/* Every packet takes a sequence number, the
+	 * nonce must never repeat */
+	enc->seq++;
+
+	/* Send the buffer out */
+	send_packet(buf, len + sizeof(*hdr), pos);
+	stats.tx_packets++;
+	stats.tx_bytes += len + sizeof(*hdr);
+}
+
+/* Apply control commands and pick up a new key before
+ * sending a frame, returns -1 when muted */
+static int
+tx_prepare(struct tx_encoder *enc)
+{
+	capture_ctl(&enc->muted);
+
+	pthread_mutex_lock(&capture_state_lock);
+	if (capture_state.tx_key_gen != enc->tx_key_gen) {
+		enc->tx_key_gen = capture_state.tx_key_gen;
+		crypto_init(&tx_crypto, &capture_state.tx_key, 1);
+	}
+	pthread_mutex_unlock(&capture_state_lock);
+
+	if (enc->muted)
+		return -1;
+	stats.tx_frames++;
+	return 0;
+}
+
+/* Encode and send stage */
+static void
+capture_encode(struct tx_encoder *enc, const struct tx_frame *f)
+{
+	unsigned char outbuf[COMPRESSED_BUF_SIZE];
+	opus_int32 max_data_bytes, outbytes;
+	uint64_t start, cpu, wall, done;
+
+	if (tx_prepare(enc) < 0)
+		return;
+
+	/* Silence is not even encoded, now and then the
+	 * far end gets told what the background sounds like */
+	if (!f->speech) {
+		stats.tx_suppressed++;
+		if (enc->silent++ % CN_INTERVAL == 0) {
+			memcpy(outbuf + sizeof(struct compressed_header),
+			       &f->cn, sizeof(f->cn));
+			tx_send(enc, PKT_CN, outbuf, sizeof(f->cn), f->pos);
+			stats.tx_cn++;
+		}
+		return;
+	}
+	enc->silent = 0;
+
+	/* Encode input buffer, leave room for the header
+	 * and the tag */
+	start = now_ns();
+	cpu = cpu_ns();
+	max_data_bytes = sizeof(outbuf) - sizeof(struct compressed_header) -
+		CRYPTO_TAG_LEN;
+	outbytes = opus_encode(opus_enc, f->pcm, f->len,
+			       outbuf + sizeof(struct compressed_header),
+			       max_data_bytes);
+	cpu = cpu_ns() - cpu;
+	wall = now_ns() - start;
+	latency_add(&stats.tx_encode, wall);
+	if (outbytes < 0) {
+		log_event(LOG_ENCODE_FAIL, outbytes, 0, 0);
+		return;
+	}
+	/* Don't need to transmit this one */
+	if (outbytes == 1) {
+		governor(cpu, wall, 0);
+		return;
+	}
+
+	tx_send(enc, PKT_MEDIA, outbuf, outbytes, f->pos);
+	stats.tx_opus_bytes += outbytes;
+
+	done = now_ns();
+	latency_add(&stats.tx_latency, done - f->read);
+	hist_add(stats.tx_latency_hist, done - f->read);
+	if (done - f->read > FRAME_NS)
+		stats.tx_late++;
+	governor(cpu, wall, done - f->read > FRAME_NS);
+}
+
+/* DSP stage thread */
+static void *
+dsp(void *data)
+{
+	struct tx_frame *in, *out;
+
+	(void)data;
+	rt_attach(RT_DSP);
+
+	while ((in = tx_next(&tx_links[TX_TO_DSP]))) {
+		out = tx_get(&tx_links[TX_TO_ENCODE]);
+		if (!out)
+			break;
+		capture_dsp(in, out);
+		tx_put(&tx_links[TX_TO_ENCODE]);
+		tx_done(&tx_links[TX_TO_DSP]);
+	}
+
+	pthread_exit(NULL);
+
+	return NULL;
+}
+
+/* Encode and send stage thread */
+static void *
+encoder(void *data)
+{
+	struct tx_encoder enc;
+	struct tx_frame *f;
+
+	(void)data;
+	log_attach(LOG_ENCODE);
+	rt_attach(RT_ENCODE);
+
+	memset(&enc, 0, sizeof(enc));
+	while ((f = tx_next(&tx_links[TX_TO_ENCODE]))) {
+		capture_encode(&enc, f);
+		tx_done(&tx_links[TX_TO_ENCODE]);
+	}
+
+	pthread_exit(NULL);
+
+	return NULL;
+}
+
+/* Input PCM thread, outbound path.  Reads frames and
+ * hands them to the DSP stage, or runs every stage
+ * itself with -S. */
+static void *
+capture(void *data)
+{
+	struct tx_frame *in = NULL, *out = NULL;
+	struct tx_encoder enc;
+	uint64_t pos;
+
+	(void)data;
+	log_attach(LOG_CAPTURE);
+	rt_attach(RT_CAPTURE);
+
+	if (fserial) {
+		in = malloc(tx_links[TX_TO_DSP].ring.esize);
+		out = malloc(tx_links[TX_TO_DSP].ring.esize);
+		if (!in || !out)
+			err(1, "malloc");
+	}
+
+	memset(&enc, 0, sizeof(enc));
+	pos = 0;
+	do {
+		if (!fserial) {
+			in = tx_get(&tx_links[TX_TO_DSP]);
+			if (!in)
+				break;
+		}
+		if (capture_read(in) < 0)
+			break;
+		in->pos = pos;
+		pos += FRAME_SIZE;
+
+		if (fserial) {
+			capture_dsp(in, out);
+			capture_encode(&enc, out);
+		} else {
+			tx_put(&tx_links[TX_TO_DSP]);
+		}
+	} while (1);
+
+	if (fserial) {
+		free(in);
+		free(out);
+	}
+
+	pthread_exit(NULL);
+
+	return NULL;
+}
+
+/* Send a packet of the -f file, @pos is its place in the
+ * stream in 16 kHz samples.  A byte or less is a DTX or
+ * lost frame, as -w writes them, there is nothing to send. */
+static void
+play_send(struct tx_encoder *enc, unsigned char *buf, size_t len,
+	  uint64_t pos)
+{
+	unsigned char cnbuf[sizeof(struct compressed_header) +
+			    sizeof(struct comfort_noise) + CRYPTO_TAG_LEN];
+	struct comfort_noise cn;
+
+	if (tx_prepare(enc) < 0)
+		return;
+
+	/* DTX frames are silence, the peer is told so now
+	 * and then as capture_encode() does */
+	if (len <= 1) {
+		stats.tx_suppressed++;
+		if (enc->silent++ % CN_INTERVAL == 0) {
+			memset(&cn, 0, sizeof(cn));
+			cn.level = PLAY_CN_LEVEL;
+			cn.tilt = 128;
+			memcpy(cnbuf + sizeof(struct compressed_header), &cn,
+			       sizeof(cn));
+			tx_send(enc, PKT_CN, cnbuf, sizeof(cn), pos);
+			stats.tx_cn++;
+		}
+		return;
+	}
+	enc->silent = 0;
+
+	tx_send(enc, PKT_MEDIA, buf, len, pos);
+	stats.tx_opus_bytes += len;
+}
+
+/* Send the Ogg Opus file.  A packet's place follows the
+ * packet durations and the granule position of each page,
+ * which is where gaps in the stream show.  Starting late
+ * means reading through what comes before. */
+static void
+play_ogg(struct tx_encoder *enc, unsigned char *buf, size_t max)
+{
+	unsigned char *payload = buf + sizeof(struct compressed_header);
+	struct ogg_reader r;
+	/* In 48 kHz samples, as granule positions are, where
+	 * the granule positions start from and where the last
+	 * packet ended */
+	uint64_t start, pos, from, granule, base, end;
+	long len;
+	int last, n, first;
+
+	/* init_play() checked the headers */
+	ogg_reader_init(&r, play_file.data, play_file.size);
+	ogg_read_packet(&r, NULL, 0, &granule, &last);
+	ogg_read_packet(&r, NULL, 0, &granule, &last);
+
+	start = now_ns();
+	from = fplay_start * 48ULL;
+	pos = 0;
+	base = 0;
+	end = 0;
+	first = 1;
+	while ((len = ogg_read_packet(&r, payload, max,
+				      &granule, &last)) >= 0) {
+		/* A jump in the granule positions is silence
+		 * too, it goes by a frame at a time */
+		for (; end + FRAME_SIZE * 3 <= pos; end += FRAME_SIZE * 3) {
+			if (end < from)
+				continue;
+			if (capture_sleep(start + (end - from) *
+				       1000000000ULL / 48000) < 0)
+				return;
+			play_send(enc, buf, 0, end / 3);
+		}
+		if (pos >= from) {
+			if (capture_sleep(start + (pos - from) *
+				       1000000000ULL / 48000) < 0)
+				break;
+			play_send(enc, buf, len, pos / 3);
+		}
+
+		n = len ? opus_packet_get_nb_samples(payload, len, 48000) : 0;
+		pos += n > 0 ? n : FRAME_SIZE * 3;
+		end = pos;
+		if (!last || granule == (uint64_t)-1)
+			continue;
+		/* The stream need not start at zero */
+		if (first) {
+			base = granule > pos ? granule - pos : 0;
+			first = 0;
+		}
+		if (granule - base > pos)
+			pos = granule - base;
+	}
+}
+
+/* Send the prompt cache, a frame after another from
+ * wherever the index says the starting one is */
+static void
+play_prompt(struct tx_encoder *enc, unsigned char *buf)
+{
+	const struct prompt *p = &play_file.prompt;
+	const uint8_t *frame;
+	uint64_t start;
+	uint32_t first, n;
+	size_t len;
+
+	start = now_ns();
+	first = (uint64_t)fplay_start * 16 / p->frame_size;
+	for (n = first; n < p->nframes; n++) {
+		if (capture_sleep(start + (uint64_t)(n - first) * p->frame_size *
+			       1000000000ULL / 16000) < 0)
+			break;
+		/* Encryption is in place, so it takes a copy */
+		frame = prompt_frame(p, n, &len);
+		memcpy(buf + sizeof(struct compressed_header), frame, len);
+		play_send(enc, buf, len, (uint64_t)n * p->frame_size);
+	}
+}
+
+/* Input thread with -f, outbound path.  Sends the packets
+ * of the file as they are once their place in the stream
+ * is due, nothing is encoded. */
+static void *
+play(void *data)
+{
+	unsigned char outbuf[COMPRESSED_BUF_SIZE];
+	struct tx_encoder enc;
+
+	(void)data;
+	log_attach(LOG_CAPTURE);
+	rt_attach(RT_CAPTURE);
+
+	memset(&enc, 0, sizeof(enc));
+	if (play_file.cache)
+		play_prompt(&enc, outbuf);
+	else
+		play_ogg(&enc, outbuf, PLAY_MAX);
+
+	capture_idle();
+
+	pthread_exit(NULL);
+
+	return NULL;
+}
+
+/* Check the Ogg Opus file for -f through once, sending
+ * then trusts it */
+static void
+check_ogg(void)
+{
+	unsigned char pkt[PLAY_MAX];
+	struct ogg_reader r;
+	uint64_t granule;
+	long len;
+	int last, n;
+
+	/* Version 0.x, mono or stereo without a mapping table,
+	 * then the comments */
+	ogg_reader_init(&r, play_file.data, play_file.size);
+	len = ogg_read_packet(&r, pkt, sizeof(pkt), &granule, &last);
+	if (len < 19 || memcmp(pkt, "OpusHead", 8) || pkt[8] >> 4 ||
+	    pkt[18])
+		errx(1, "%s: Not an Ogg Opus file", fplay);
+	len = ogg_read_packet(&r, NULL, 0, &granule, &last);
+	if (len < 0)
+		errx(1, "%s: Not an Ogg Opus file", fplay);
+
+	/* The peer decodes a frame at a time */
+	while ((len = ogg_read_packet(&r, pkt, sizeof(pkt),
+				      &granule, &last)) >= 0) {
+		if (len <= 1)
+			continue;
+		n = opus_packet_get_nb_samples(pkt, len, 16000);
+		if (n < 0)
+			errx(1, "%s: Invalid Opus packet", fplay);
+		if (n > FRAME_SIZE)
+			errx(1, "%s: Packets over 20 ms are not supported",
+			     fplay);
+	}
+	if (r.off != play_file.size)
+		errx(1, "%s: Bad page or packet at offset %zu", fplay, r.off);
+}
+
+/* Check every frame of the prompt cache for -f once,
+ * prompt_open() only made sure they are in the file */
+static void
+check_prompt(void)
+{
+	const struct prompt *p = &play_file.prompt;
+	const uint8_t *frame;
+	uint32_t i;
+	size_t len;
+	int n;
+
+	if (p->frame_size != FRAME_SIZE)
+		errx(1, "%s: Frames are not 20 ms", fplay);
+	for (i = 0; i < p->nframes; i++) {
+		frame = prompt_frame(p, i, &len);
+		/* Sent from a packet buffer */
+		if (len > PLAY_MAX)
+			errx(1, "%s: Frame %u is too long", fplay, i);
+		if (len <= 1)
+			continue;
+		n = opus_packet_get_nb_samples(frame, len, 16000);
+		if (n < 0)
+			errx(1, "%s: Invalid Opus packet in frame %u",
+			     fplay, i);
+		if (n > FRAME_SIZE)
+			errx(1, "%s: Frames over 20 ms are not supported",
+			     fplay);
+	}
+}
+
+/* Map the -i file and work out its format, before
+ * anything depends on the input rate */
+static void
+init_input(void)
+{
+	struct pcm_format *fmt = &input_file.fmt;
+	struct stat st;
+	void *p;
+	int fd, ret;
+
+	in_rate = frate;
+	in_frame_len = FRAME_SIZE * in_rate / 16000;
+	if (!finput)
+		return;
+
+	fd = open(finput, O_RDONLY);
+	if (fd < 0)
+		err(1, "%s", finput);
+	if (fstat(fd, &st) < 0)
+		err(1, "%s", finput);
+	if (!st.st_size)
+		errx(1, "%s: Empty file", finput);
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		err(1, "mmap");
+	close(fd);
+	madvise(p, st.st_size, MADV_SEQUENTIAL);
+	input_file.data = p;
+	input_file.size = st.st_size;
+
+	ret = wav_parse(input_file.data, input_file.size, fmt);
+	if (ret == -2)
+		errx(1, "%s: Unsupported WAV format", finput);
+	if (ret < 0) {
+		/* Raw samples, as on the standard input */
+		fmt->rate = frate;
+		fmt->bits = 16;
+		fmt->channels = fchan;
+		fmt->offset = 0;
+		fmt->len = input_file.size -
+			input_file.size % pcm_frame_bytes(fmt);
+	}
+
+	/* A frame must be a whole number of input samples,
+	 * or pacing by frames drifts from the file */
+	in_rate = fmt->rate;
+	if (FRAME_SIZE * in_rate % 16000)
+		errx(1, "%s: Unsupported sample rate: %d", finput, in_rate);
+	in_frame_len = FRAME_SIZE * in_rate / 16000;
+}
+
+static void
+deinit_input(void)
+{
+	if (!finput)
+		return;
+	munmap((void *)input_file.data, input_file.size);
+}
+
+/* Map the file for -f, a prompt cache or Ogg Opus */
+static void
+init_play(void)
+{
+	struct stat st;
+	void *p;
+	int fd;
+
+	if (!fplay)
+		return;
+
+	fd = open(fplay, O_RDONLY);
+	if (fd < 0)
+		err(1, "%s", fplay);
+	if (fstat(fd, &st) < 0)
+		err(1, "%s", fplay);
+	if (!st.st_size)
+		errx(1, "%s: Not an Ogg Opus file", fplay);
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		err(1, "mmap");
+	close(fd);
+	play_file.data = p;
+	play_file.size = st.st_size;
+
+	if (play_file.size < 8 ||
+	    memcmp(play_file.data, PROMPT_MAGIC, 8)) {
+		check_ogg();
+		return;
+	}
+	if (prompt_open(&play_file.prompt, play_file.data,
+			play_file.size) < 0)
+		errx(1, "%s: Bad prompt cache", fplay);
+	check_prompt();
+	play_file.cache = 1;
+}
+
+static void
+deinit_play(void)
+{
+	if (!fplay)
+		return;
+	munmap((void *)play_file.data, play_file.size);
+}
+
+/* Set up the capture stages, the read stage is
+ * started by the caller */
+static void
+init_capture(void)
+{
+	int i, ret;
+
+	tx_frame_max = (in_frame_len > FRAME_SIZE ?
+			in_frame_len : FRAME_SIZE) + 8;
+	vad_init(&tx_vad);
+	if (pipe(capture_priv.wake) < 0)
+		err(1, "pipe");
+	set_nonblocking(capture_priv.wake[0]);
+	set_nonblocking(capture_priv.wake[1]);
+	for (i = 0; i < NR_TX_LINKS; i++) {
+		if (ring_init(&tx_links[i].ring, TX_QUEUE,
+			      sizeof(struct tx_frame) +
+			      tx_frame_max * sizeof(spx_int16_t)) < 0)
+			err(1, "malloc");
+		sem_init(&tx_links[i].free, 0, TX_QUEUE);
+		sem_init(&tx_links[i].ready, 0, 0);
+	}
+
+	/* Nothing to process when sending a file */
+	if (fserial || fplay)
+		return;
+
+	ret = pthread_create(&dsp_thread, &thread_attr, dsp, NULL);
+	if (ret) {
+		errno = ret;
+		err(1, "pthread_create");
+	}
+	ret = pthread_create(&encode_thread, &thread_attr, encoder, NULL);
+	if (ret) {
+		errno = ret;
+		err(1, "pthread_create");
+	}
+}
+
+/* Stop the capture stages, capture_state.quit is set */
+static void
+deinit_capture(void)
+{
+	int i;
+
+	/* Wake up whichever stage is waiting on another,
+	 * or on the input */
+	for (i = 0; i < NR_TX_LINKS; i++) {
+		sem_post(&tx_links[i].free);
+		sem_post(&tx_links[i].ready);
+	}
+	if (write(capture_priv.wake[1], "", 1) < 0)
+		warn("write");
+	pthread_join(capture_thread, NULL);
+	if (!fserial && !fplay) {
+		pthread_join(dsp_thread, NULL);
+		pthread_join(encode_thread, NULL);
+	}
+	for (i = 0; i < NR_TX_LINKS; i++) {
+		ring_free(&tx_links[i].ring);
+		sem_destroy(&tx_links[i].free);
+		sem_destroy(&tx_links[i].ready);
+	}
+	close(capture_priv.wake[0]);
+	close(capture_priv.wake[1]);
+}
+
+/* Encode the input into a prompt cache for -f, resampled
+ * and processed as in a call, then exit */
+static void
+build_prompt(void)
+{
+	unsigned char buf[PLAY_MAX];
+	spx_int16_t *in, out[2 * FRAME_SIZE];
+	spx_uint32_t inlen, outlen;
+	struct prompt_writer w;
+	size_t want, got;
+	ssize_t bytes;
+	opus_int32 len;
+	FILE *fp;
+
+	in = malloc(in_frame_len * sizeof(*in));
+	if (!in)
+		err(1, "malloc");
+
+	fp = fopen(fprompt, "w");
+	if (!fp)
+		err(1, "%s", fprompt);
+	if (prompt_create(&w, fp, FRAME_SIZE) < 0)
+		err(1, "%s", fprompt);
+
+	want = in_frame_len * sizeof(*in);
+	do {
+		if (finput) {
+			got = input_frame(in) * sizeof(*in);
+		} else {
+			for (got = 0; got < want; got += bytes) {
+				bytes = read(STDIN_FILENO, (char *)in + got,
+					     want - got);
+				if (bytes < 0 && errno == EINTR)
+					bytes = 0;
+				else if (bytes < 0)
+					err(1, "read");
+				else if (!bytes)
+					break;
+			}
+			/* The last frame is padded with silence */
+			memset((char *)in + got, 0, want - got);
+		}
+		if (!got)
+			break;
+
+		inlen = in_frame_len;
+		outlen = 2 * FRAME_SIZE;
+		speex_resampler_process_int(speex_resampler_tx, 0,
+					    in, &inlen, out, &outlen);
+		if (outlen < FRAME_SIZE)
+			memset(out + outlen, 0,
+			       (FRAME_SIZE - outlen) * sizeof(out[0]));
+		if (speex_preprocess)
+			speex_preprocess_run(speex_preprocess, out);
+
+		len = opus_encode(opus_enc, out, FRAME_SIZE, buf, sizeof(buf));
+		if (len < 0)
+			errx(1, "opus_encode: %s", opus_strerror(len));
+		if (prompt_add(&w, buf, len) < 0)
+			err(1, "%s", fprompt);
+	} while (got == want);
+
+	if (prompt_finish(&w) < 0 || fclose(fp) == EOF)
+		err(1, "%s", fprompt);
+	free(in);
+
+	if (fverbose)
+		printf("%s: %u frames\n", fprompt, w.nframes);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"usage: %s [OPTIONS] <remote-addr> <remote-port> <local-port>\n", argv0);
+	fprintf(stderr, " -b\tBits per sample\n");
+	fprintf(stderr, " -r\tSamples per second (in a single channel)\n");
+	fprintf(stderr, " -c\tNumber of channels\n");
+	fprintf(stderr, " -d\tOverride default driver ID\n");
+	fprintf(stderr, " -k\tAuthenticate with the pre-shared key in this file\n");
+	fprintf(stderr, " -t\tKeep a session ticket in this file\n");
+	fprintf(stderr, " -n\tDo not encrypt the stream\n");
+	fprintf(stderr, " -A\tAccept packets from any address\n");
+	fprintf(stderr, " -s\tListen for commands on this Unix socket\n");
+	fprintf(stderr, " -p\tPace outgoing packets, offset in msec\n");
+	fprintf(stderr, " -P\tLet the kernel pace with SO_TXTIME, needs fq or etf\n");
+	fprintf(stderr, " -R\tReal-time priority of the audio threads, [rr:]prio\n");
+	fprintf(stderr, " -C\tPin the receive,capture,playback,pacer,decode,dsp,encode threads to CPUs\n");
+	fprintf(stderr, " -L\tLock all memory\n");
+	fprintf(stderr, " -S\tRead, resample and encode on a single thread\n");
+	fprintf(stderr, " -D\tDo not send silence\n");
+	fprintf(stderr, " -E\tCancel echo, sink latency in msec\n");
+	fprintf(stderr, " -N\tSuppress noise and level the input\n");
+	fprintf(stderr, " -H\tRelease the decoder after this many seconds idle\n");
+	fprintf(stderr, " -w\tRecord the received stream to this Ogg Opus file\n");
+	fprintf(stderr, " -i\tRead the input from this WAV or raw file\n");
+	fprintf(stderr, " -f\tSend this Ogg Opus file or prompt cache instead of the input\n");
+	fprintf(stderr, " -o\tStart sending the file this many msec in\n");
+	fprintf(stderr, " -W\tEncode the input into this prompt cache and exit\n");
+	fprintf(stderr, " -v\tEnable verbose output\n");
+	fprintf(stderr, " -V\tPrint version information\n");
+	fprintf(stderr, " -h\tThis help screen\n");
+}
+
+static void
+sig_handler(int signum)
+{
+	int saved = errno;
+	ssize_t ret;
+
+	switch (signum) {
+	case SIGINT:
+		handle_sigint = 1;
+		break;
+	case SIGUSR1:
+		fverbose = !fverbose;
+		break;
+	case SIGUSR2:
+		handle_sigusr2 = 1;
+		break;
+	default:
+		break;
+	}
+	ret = write(sig_pipe[1], "", 1);
+	(void)ret;
+	errno = saved;
+}
+
+/* Print the bucket 99 percent of the samples in
+ * @hist fall under */
+static void
+dump_p99(FILE *fp, const char *name, const uint64_t *hist)
+{
+	uint64_t total = 0, sum = 0;
+	int i;
+
+	for (i = 0; i < NR_HIST; i++)
+		total += hist[i];
+	if (!total)
+		return;
+	for (i = 0; i < NR_HIST - 1; i++) {
+		sum += hist[i];
+		if (sum * 100 >= total * 99)
+			break;
+	}
+	if (i == NR_HIST - 1)
+		fprintf(fp, "%s p99 (usec): >=%d\n", name, 1 << (i - 1));
+	else
+		fprintf(fp, "%s p99 (usec): <%d\n", name, 1 << i);
+}
+
+/* Print the non-empty buckets of @hist on one line */
+static void
+dump_hist(FILE *fp, const char *name, const uint64_t *hist)
+{
+	int i, any = 0;
+
+	for (i = 0; i < NR_HIST; i++) {
+		if (!hist[i])
+			continue;
+		if (!any++)
+			fprintf(fp, "%s (usec):", name);
+		if (i == NR_HIST - 1)
+			fprintf(fp, " >=%d: %llu", 1 << (i - 1),
+				(unsigned long long)hist[i]);
+		else
+			fprintf(fp, " <%d: %llu", 1 << i,
+				(unsigned long long)hist[i]);
+	}
+	if (any)
+		fputc('\n', fp);
+}
+
+static void
+dump_stats(FILE *fp)
+{
+	uint64_t dropped = 0, now, n;
+	struct latency *lat;
+	int i;
+
+	fprintf(fp, "rx packets: %llu\n",
+		(unsigned long long)stats.rx_packets);
+	fprintf(fp, "rx bytes: %llu\n",
+		(unsigned long long)stats.rx_bytes);
+	fprintf(fp, "rx lost: %llu\n",
+		(unsigned long long)stats.rx_lost);
+	fprintf(fp, "rx queue drops: %llu\n",
+		(unsigned long long)stats.rx_queue_drops);
+	fprintf(fp, "rx network loss: %llu\n",
+		stats.rx_lost > stats.rx_queue_drops ?
+		(unsigned long long)(stats.rx_lost - stats.rx_queue_drops) : 0);
+	for (i = 0; i < NR_REJECT; i++)
+		fprintf(fp, "rx rejected (%s): %llu\n", reject_names[i],
+			(unsigned long long)stats.rx_reject[i]);
+	if (crypto_enabled && stats.rx_packets)
+		fprintf(fp, "rx crypto per packet (nsec): %llu\n",
+			(unsigned long long)(stats.rx_crypto_ns /
+					     stats.rx_packets));
+	fprintf(fp, "rx jitter (usec): %llu\n",
+		(unsigned long long)(stats.rx_jitter >> 4) * 1000000 / 16000);
+	fprintf(fp, "rx max burst: %u\n", stats.rx_burst_max);
+	fprintf(fp, "rx socket buffer: %d\n", stats.rx_rcvbuf);
+	for (i = 0; i < NR_LOG_RINGS; i++)
+		dropped += log_dropped[i];
+	fprintf(fp, "log records dropped: %llu\n",
+		(unsigned long long)dropped);
+	fprintf(fp, "tx packets: %llu\n",
+		(unsigned long long)stats.tx_packets);
+	fprintf(fp, "tx bytes: %llu\n",
+		(unsigned long long)stats.tx_bytes);
+	if (crypto_enabled) {
+		fprintf(fp, "tx frames before handshake: %llu\n",
+			(unsigned long long)stats.tx_nokey);
+		fprintf(fp, "handshakes: %u (%u resumed)\n",
+			stats.hs_count, stats.hs_resumed);
+		fprintf(fp, "last handshake (usec): %llu\n",
+			(unsigned long long)stats.hs_usec);
+		fprintf(fp, "handshake restarts refused: %llu\n",
+			(unsigned long long)stats.hs_refused);
+	}
+	if (crypto_enabled && stats.tx_packets)
+		fprintf(fp, "tx crypto per packet (nsec): %llu\n",
+			(unsigned long long)(stats.tx_crypto_ns /
+					     stats.tx_packets));
+	if (fvad)
+		fprintf(fp, "tx silent frames: %llu (%llu comfort noise)\n",
+			(unsigned long long)stats.tx_suppressed,
+			(unsigned long long)stats.tx_cn);
+	if (stats.rx_cn)
+		fprintf(fp, "rx comfort noise: %llu (%llu frames played)\n",
+			(unsigned long long)stats.rx_cn,
+			(unsigned long long)stats.rx_cn_frames);
+	fprintf(fp, "rx frames concealed: %llu (%llu with FEC)\n",
+		(unsigned long long)(stats.rx_plc + stats.rx_fec),
+		(unsigned long long)stats.rx_fec);
+	if (stats.rx_queue_delay.count)
+		fprintf(fp, "rx queue delay (usec): avg %llu max %llu\n",
+			(unsigned long long)(stats.rx_queue_delay.total_ns /
+					     stats.rx_queue_delay.count / 1000),
+			(unsigned long long)(stats.rx_queue_delay.max_ns / 1000));
+	fprintf(fp, "codec memory (bytes): encoder %d, decoders %d\n",
+		stats.tx_codec_bytes,
+		codec_pool.allocated * opus_decoder_get_size(fchan));
+	if (fhibernate)
+		fprintf(fp, "rx decoder released: %llu times\n",
+			(unsigned long long)stats.rx_hibernated);
+	dump_hist(fp, "rx decoder setup", stats.rx_setup);
+	if (stats.rx_decode.count) {
+		fprintf(fp, "rx decode (usec): avg %llu max %llu\n",
+			(unsigned long long)(stats.rx_decode.total_ns /
+					     stats.rx_decode.count / 1000),
+			(unsigned long long)(stats.rx_decode.max_ns / 1000));
+		dump_p99(fp, "rx decode", stats.rx_decode_hist);
+	}
+	if (stats.rx_queue_delay.count)
+		fprintf(fp, "rx packets over deadline: %llu (%.2f%%)\n",
+			(unsigned long long)stats.rx_late,
+			100.0 * stats.rx_late / stats.rx_queue_delay.count);
+	fprintf(fp, "rx load shedding level: %d (raised %llu times)\n",
+		stats.rx_shed_level, (unsigned long long)stats.rx_shed_raised);
+	fprintf(fp, "rx shed: %llu frames not concealed, %llu packets dropped\n",
+		(unsigned long long)stats.rx_shed_conceal,
+		(unsigned long long)stats.rx_shed_drops);
+	if (stats.rx_shed_refused)
+		fprintf(fp, "rx decoder complexity refused: %llu times\n",
+			(unsigned long long)stats.rx_shed_refused);
+	if (frecord) {
+		fprintf(fp, "recorded packets: %llu (%llu lost, %llu late, %llu jumps)\n",
+			(unsigned long long)stats.rec_packets,
+			(unsigned long long)stats.rec_plc,
+			(unsigned long long)stats.rec_late,
+			(unsigned long long)stats.rec_resync);
+		fprintf(fp, "recorded bytes: %llu (%llu pages dropped, %llu write errors)\n",
+			(unsigned long long)stats.rec_bytes,
+			(unsigned long long)stats.rec_dropped,
+			(unsigned long long)stats.rec_errors);
+	}
+	fprintf(fp, "tx complexity: %d (lowered %llu, raised %llu times)\n",
+		stats.tx_complexity, (unsigned long long)stats.tx_gov_down,
+		(unsigned long long)stats.tx_gov_up);
+	if (stats.tx_encode.count)
+		fprintf(fp, "tx encode (usec): avg %llu max %llu\n",
+			(unsigned long long)(stats.tx_encode.total_ns /
+					     stats.tx_encode.count / 1000),
+			(unsigned long long)(stats.tx_encode.max_ns / 1000));
+	if (stats.tx_aec.count)
+		fprintf(fp, "tx echo canceller CPU (usec): avg %llu max %llu\n",
+			(unsigned long long)(stats.tx_aec.total_ns /
+					     stats.tx_aec.count / 1000),
+			(unsigned long long)(stats.tx_aec.max_ns / 1000));
+	if (stats.tx_preprocess.count)
+		fprintf(fp, "tx noise suppression CPU (usec): avg %llu max %llu\n",
+			(unsigned long long)(stats.tx_preprocess.total_ns /
+					     stats.tx_preprocess.count / 1000),
+			(unsigned long long)(stats.tx_preprocess.max_ns / 1000));
+	/* Over all frames that could have been sent, so
+	 * silence that was not brings the average down */
+	if (stats.tx_frames)
+		fprintf(fp, "tx average bitrate (kbit/s): %.1f\n",
+			stats.tx_opus_bytes * 8.0 * 1000000000.0 /
+			(stats.tx_frames * FRAME_NS) / 1000);
+	if (stats.tx_latency.count) {
+		fprintf(fp, "tx read to send (usec): avg %llu max %llu\n",
+			(unsigned long long)(stats.tx_latency.total_ns /
+					     stats.tx_latency.count / 1000),
+			(unsigned long long)(stats.tx_latency.max_ns / 1000));
+		dump_p99(fp, "tx read to send", stats.tx_latency_hist);
+		fprintf(fp, "tx frames over deadline: %llu (%.2f%%)\n",
+			(unsigned long long)stats.tx_late,
+			100.0 * stats.tx_late / stats.tx_latency.count);
+	}
+	for (i = 0; i < NR_RT_THREADS; i++) {
+		lat = &stats.sched_lat[i];
+		if (!lat->count)
+			continue;
+		fprintf(fp, "%s wake-up latency (usec): avg %llu max %llu\n",
+			rt_names[i],
+			(unsigned long long)(lat->total_ns / lat->count / 1000),
+			(unsigned long long)(lat->max_ns / 1000));
+	}
+	now = now_ns();
+	for (i = 0; i < NR_RT_THREADS; i++) {
+		n = stats.wakeups[i] - wakeups_last[i];
+		wakeups_last[i] = stats.wakeups[i];
+		if (!n || now <= wakeups_since)
+			continue;
+		fprintf(fp, "%s wake-ups per second: %.1f\n", rt_names[i],
+			n * 1e9 / (now - wakeups_since));
+	}
+	wakeups_since = now;
+	fflush(fp);
+}
+
+static void
+ctl_close(struct ctl_client *c)
+{
+	close(c->fd);
+	c->fd = -1;
+	c->len = 0;
+	free(c->out);
+	c->out = NULL;
+	c->out_len = 0;
+	c->out_size = 0;
+}
+
+/* Send as much of the pending output as the socket
+ * takes, the client is closed if it went away */
+static void
+ctl_flush(struct ctl_client *c)
+{
+	ssize_t n;
+
+	while (c->out_len) {
+		n = send(c->fd, c->out, c->out_len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			return;
+		if (n < 0) {
+			ctl_close(c);
+			return;
+		}
+		memmove(c->out, c->out + n, c->out_len - n);
+		c->out_len -= n;
+	}
+}
+
+/* Queue @len bytes for the client and send them */
+static void
+ctl_write(struct ctl_client *c, const void *buf, size_t len)
+{
+	char *out;
+
+	if (c->fd < 0)
+		return;
+	if (c->out_len + len > CTL_OUT_MAX) {
+		ctl_close(c);
+		return;
+	}
+	if (c->out_len + len > c->out_size) {
+		out = realloc(c->out, c->out_len + len);
+		if (!out)
+			err(1, "realloc");
+		c->out = out;
+		c->out_size = c->out_len + len;
+	}
+	memcpy(c->out + c->out_len, buf, len);
+	c->out_len += len;
+	ctl_flush(c);
+}
+
+static void
+ctl_reply(struct ctl_client *c, const char *fmt, ...)
+{
+	char buf[CTL_LINE_SIZE];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (len >= (int)sizeof(buf))
+		len = sizeof(buf) - 1;
+	if (len > 0)
+		ctl_write(c, buf, len);
+}
+
+/* Parse an integer argument in [@min, @max] */
+static int
+ctl_arg(const char *arg, int min, int max, int *value)
+{
+	char *end;
+	long v;
+
+	if (!arg)
+		return -1;
+	errno = 0;
+	v = strtol(arg, &end, 10);
+	if (errno || *end || end == arg || v < min || v > max)
+		return -1;
+	*value = v;
+	return 0;
+}
+
+/* Pass a command on to another thread */
+static void
+ctl_send(struct ctl_client *c, int ring, int op, int value)
+{
+	struct ctl_cmd cmd;
+
+	cmd.op = op;
+	cmd.value = value;
+	if (ring_push(&ctl_rings[ring], &cmd) < 0)
+		ctl_reply(c, "error: busy\n");
+	else
+		ctl_reply(c, "ok\n");
+}
+
+static void
+ctl_stats(struct ctl_client *c)
+{
+	char *buf;
+	size_t len;
+	FILE *fp;
+
+	fp = open_memstream(&buf, &len);
+	if (!fp) {
+		ctl_reply(c, "error: %s\n", strerror(errno));
+		return;
+	}
+	dump_stats(fp);
+	fclose(fp);
+	ctl_write(c, buf, len);
+	free(buf);
+	ctl_reply(c, "ok\n");
+}
+
+/* Run a single command from the control socket */
+static void
+ctl_command(struct ctl_client *c, char *line)
+{
+	static const char *levels[] = { "warn", "info", "debug" };
+	char *cmd, *arg, *save;
+	int value, i;
+
+	cmd = strtok_r(line, " \t\r", &save);
+	if (!cmd)
+		return;
+	arg = strtok_r(NULL, " \t\r", &save);
 
-/* State of the capture thread */
-struct capture_state {
-	int quit;
-} capture_state;
+	if (!strcmp(cmd, "help")) {
+		ctl_reply(c, "stats\n"
+			  "bitrate <bits per second>|auto\n"
+			  "complexity <0-10>|auto\n"
+			  "fec <expected loss in percent, 0 is off>\n"
+			  "jitter <packets to buffer>\n"
+			  "mute on|off\n"
+			  "log warn|info|debug\n"
+			  "ok\n");
+	} else if (!strcmp(cmd, "stats")) {
+		ctl_stats(c);
+	} else if (!strcmp(cmd, "bitrate")) {
+		if (arg && !strcmp(arg, "auto"))
+			ctl_send(c, CTL_CAPTURE, CTL_BITRATE, OPUS_AUTO);
+		else if (!ctl_arg(arg, 500, 512000, &value))
+			ctl_send(c, CTL_CAPTURE, CTL_BITRATE, value);
+		else
+			ctl_reply(c, "error: invalid bitrate\n");
+	} else if (!strcmp(cmd, "complexity")) {
+		if (arg && !strcmp(arg, "auto"))
+			ctl_send(c, CTL_CAPTURE, CTL_COMPLEXITY, -1);
+		else if (!ctl_arg(arg, 0, 10, &value))
+			ctl_send(c, CTL_CAPTURE, CTL_COMPLEXITY, value);
+		else
+			ctl_reply(c, "error: invalid complexity\n");
+	} else if (!strcmp(cmd, "fec")) {
+		if (!ctl_arg(arg, 0, 100, &value))
+			ctl_send(c, CTL_CAPTURE, CTL_FEC, value);
+		else
+			ctl_reply(c, "error: invalid loss percentage\n");
+	} else if (!strcmp(cmd, "jitter")) {
+		if (!ctl_arg(arg, 0, MAX_QUEUED, &value))
+			ctl_send(c, CTL_DECODE, CTL_JITTER, value);
+		else
+			ctl_reply(c, "error: invalid jitter target\n");
+	} else if (!strcmp(cmd, "mute")) {
+		if (arg && (!strcmp(arg, "on") || !strcmp(arg, "off")))
+			ctl_send(c, CTL_CAPTURE, CTL_MUTE, !strcmp(arg, "on"));
+		else
+			ctl_reply(c, "error: expected on or off\n");
+	} else if (!strcmp(cmd, "log")) {
+		for (i = 0; arg && i < (int)LEN(levels); i++)
+			if (!strcmp(arg, levels[i]))
+				break;
+		if (arg && i < (int)LEN(levels)) {
+			__atomic_store_n(&log_level, i, __ATOMIC_RELAXED);
+			ctl_reply(c, "ok\n");
+		} else {
+			ctl_reply(c, "error: invalid log level\n");
+		}
+	} else {
+		ctl_reply(c, "error: unknown command %s\n", cmd);
+	}
+}
 
-/* Lock that protects playback_state */
-static pthread_mutex_t playback_state_lock;
-/* Lock that protects capture_state */
-static pthread_mutex_t capture_state_lock;
+/* Read whatever a client sent and run every
+ * complete line */
+static void
+ctl_read(struct ctl_client *c)
+{
+	char *nl;
+	ssize_t n;
+	size_t used;
 
-/* Set to 1 when SIGINT is received */
-static volatile sig_atomic_t handle_sigint;
+	n = read(c->fd, c->line + c->len, sizeof(c->line) - 1 - c->len);
+	if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+		ctl_close(c);
+		return;
+	}
+	if (n < 0)
+		return;
+	c->len += n;
+	c->line[c->len] = '\0';
 
-/* Play back audio from the client */
-static void *
-playback(void *data)
+	while ((nl = strchr(c->line, '\n'))) {
+		*nl = '\0';
+		used = nl - c->line + 1;
+		ctl_command(c, c->line);
+		/* Dropped for not reading its replies */
+		if (c->fd < 0)
+			return;
+		memmove(c->line, c->line + used, c->len - used + 1);
+		c->len -= used;
+	}
+
+	/* No newline in a full buffer, give up on it */
+	if (c->len == sizeof(c->line) - 1) {
+		/* Best effort, the client goes away anyway */
+		ctl_reply(c, "error: line too long\n");
+		ctl_close(c);
+	}
+}
+
+/* Called from the main loop, serve the control socket */
+static void
+ctl_poll(void)
 {
-	struct compressed_buf *cbuf;
-	struct list_head *iter, *q;
-	struct playback_state *state = data;
-	struct timespec ts;
-	struct timeval tp;
-	int rc;
-	opus_int16 pcm[FRAME_SIZE];
-	spx_int16_t *pcm_sample_convert;
-	spx_uint32_t inlen;
-	spx_uint32_t outlen;
-	int ret;
+	int fd, i;
 
-	/* Prepare the resampler configuration */
-	/* Input length is in frames */
-	inlen = FRAME_SIZE;
-	outlen = (FRAME_SIZE * 16000) / 8000;
-	outlen *= frate;
-	/* Output length is in bytes */
-	outlen /= 16000;
-	pcm_sample_convert = malloc(outlen);
-	if (!pcm_sample_convert)
-		err(1, "malloc");
+	if (ctl_sockfd < 0)
+		return;
 
-	do {
-		pthread_mutex_lock(&compressed_buf_lock);
-		gettimeofday(&tp, NULL);
-		/* Convert from timeval to timespec */
-		ts.tv_sec = tp.tv_sec;
-		ts.tv_nsec = tp.tv_usec * 1000;
-		/* Default to a 3 second wait internal */
-		ts.tv_sec += 3;
-
-		if (list_empty(&compressed_buf.list)) {
-			/* Wait in the worst case 3 seconds to give some
-			 * grace to perform cleanup if necessary */
-			rc = pthread_cond_timedwait(&tx_pcm_cond,
-						    &compressed_buf_lock,
-						    &ts);
-			if (rc == ETIMEDOUT)
-				if (fverbose)
-					printf("Output thread is starving...\n");
+	fd = accept(ctl_sockfd, NULL, NULL);
+	if (fd >= 0) {
+		for (i = 0; i < CTL_MAX_CLIENTS; i++)
+			if (ctl_clients[i].fd < 0)
+				break;
+		if (i == CTL_MAX_CLIENTS) {
+			close(fd);
+		} else {
+			set_nonblocking(fd);
+			ctl_clients[i].fd = fd;
+			ctl_clients[i].len = 0;
 		}
+	}
 
-		pthread_mutex_lock(&playback_state_lock);
-		if (state->quit) {
-			pthread_mutex_unlock(&playback_state_lock);
-			pthread_mutex_unlock(&compressed_buf_lock);
-			break;
-		}
-		pthread_mutex_unlock(&playback_state_lock);
+	for (i = 0; i < CTL_MAX_CLIENTS; i++) {
+		if (ctl_clients[i].fd >= 0 && ctl_clients[i].out_len)
+			ctl_flush(&ctl_clients[i]);
+		if (ctl_clients[i].fd >= 0)
+			ctl_read(&ctl_clients[i]);
+	}
+}
 
-		/* Dequeue, decode and play buffers via libao */
-		list_for_each_safe(iter, q, &compressed_buf.list) {
-			cbuf = list_entry(iter, struct compressed_buf,
-					  list);
-
-			/* Decode compressed buffer */
-			ret = opus_decode(opus_dec, cbuf->buf, cbuf->len,
-					  pcm, FRAME_SIZE, 0);
-			if (ret < 0) {
-				warnx("Failed to decode input packet: %d", ret);
-				/* Play silence if the decode failed */
-				memset(pcm_sample_convert, 0, outlen);
-			} else {
-				/* Sample convert the RX path */
-				speex_resampler_process_int(speex_resampler_rx,
-							    0, (void *)pcm, &inlen,
-							    (void *)pcm_sample_convert,
-							    &outlen);
-				/* Outlen is in frames, convert to bytes */
-				outlen *= 2;
-			}
+/* Add the control socket and its clients to @pfd,
+ * returns how many were added */
+static int
+ctl_pollfds(struct pollfd *pfd)
+{
+	int i, n = 0;
 
-			/* Play via libao */
-			ao_play(device, (void *)pcm_sample_convert,
-				outlen);
+	if (ctl_sockfd < 0)
+		return 0;
+	pfd[n].fd = ctl_sockfd;
+	pfd[n++].events = POLLIN;
+	for (i = 0; i < CTL_MAX_CLIENTS; i++) {
+		if (ctl_clients[i].fd < 0)
+			continue;
+		pfd[n].fd = ctl_clients[i].fd;
+		pfd[n++].events = POLLIN |
+			(ctl_clients[i].out_len ? POLLOUT : 0);
+	}
+	return n;
+}
 
-			free(cbuf->buf);
-			list_del(&cbuf->list);
-			free(cbuf);
-		}
-		pthread_mutex_unlock(&compressed_buf_lock);
-	} while (1);
+static void
+init_ctl(void)
+{
+	struct sockaddr_un sun;
+	mode_t mask;
+	int i;
 
-	free(pcm_sample_convert);
+	for (i = 0; i < NR_CTL_RINGS; i++)
+		if (ring_init(&ctl_rings[i], 16, sizeof(struct ctl_cmd)) < 0)
+			err(1, "malloc");
 
-	pthread_exit(NULL);
+	for (i = 0; i < CTL_MAX_CLIENTS; i++)
+		ctl_clients[i].fd = -1;
 
-	return NULL;
+	if (!fctlpath)
+		return;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(fctlpath) >= sizeof(sun.sun_path))
+		errx(1, "Control socket path too long: %s", fctlpath);
+	strcpy(sun.sun_path, fctlpath);
+
+	ctl_sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (ctl_sockfd < 0)
+		err(1, "socket");
+	unlink(fctlpath);
+	/* Only the owner gets to control the call */
+	mask = umask(077);
+	if (bind(ctl_sockfd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+		err(1, "bind %s", fctlpath);
+	umask(mask);
+	if (listen(ctl_sockfd, CTL_MAX_CLIENTS) < 0)
+		err(1, "listen");
+	set_nonblocking(ctl_sockfd);
 }
 
 static void
-enqueue_for_playback(struct compressed_buf *cbuf)
+deinit_ctl(void)
 {
-	pthread_mutex_lock(&compressed_buf_lock);
-	list_add_tail(&cbuf->list, &compressed_buf.list);
-	pthread_cond_signal(&tx_pcm_cond);
-	pthread_mutex_unlock(&compressed_buf_lock);
+	int i;
+
+	for (i = 0; i < CTL_MAX_CLIENTS; i++)
+		if (ctl_clients[i].fd >= 0)
+			ctl_close(&ctl_clients[i]);
+	if (ctl_sockfd >= 0) {
+		close(ctl_sockfd);
+		unlink(fctlpath);
+	}
+	for (i = 0; i < NR_CTL_RINGS; i++)
+		ring_free(&ctl_rings[i]);
 }
 
-/* Parse the compressed packet and enqueue it for
- * playback */
+/* Ask the kernel for arrival timestamps and queue
+ * overflow counts on the receive socket */
 static void
-process_compressed_packet(const void *buf, size_t len)
+init_rx_socket(int sockfd)
 {
-	struct compressed_buf *cbuf;
-	uint32_t sig;
-	struct compressed_header *hdr;
+	int optval;
+	socklen_t optlen;
 
-	cbuf = malloc(sizeof(*cbuf));
-	if (!cbuf)
-		err(1, "malloc");
-	memset(cbuf, 0, sizeof(*cbuf));
+	optval = 1;
+#if defined(SO_TIMESTAMPNS)
+	if (setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS,
+		       &optval, sizeof(optval)) < 0)
+		warn("setsockopt SO_TIMESTAMPNS");
+#elif defined(SO_TIMESTAMP)
+	if (setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMP,
+		       &optval, sizeof(optval)) < 0)
+		warn("setsockopt SO_TIMESTAMP");
+#endif
+#ifdef SO_RXQ_OVFL
+	if (setsockopt(sockfd, SOL_SOCKET, SO_RXQ_OVFL,
+		       &optval, sizeof(optval)) < 0)
+		warn("setsockopt SO_RXQ_OVFL");
+#endif
 
-	cbuf->len = len - sizeof(*hdr);
-	cbuf->buf = malloc(cbuf->len);
-	if (!cbuf->buf)
-		err(1, "malloc");
+	optlen = sizeof(stats.rx_rcvbuf);
+	if (getsockopt(sockfd, SOL_SOCKET, SO_RCVBUF,
+		       &stats.rx_rcvbuf, &optlen) < 0)
+		warn("getsockopt");
+}
 
-	memcpy(cbuf->buf, buf + sizeof(*hdr),
-	       cbuf->len);
+/* Grow the socket receive buffer so that a burst of
+ * @depth packets fits in it */
+static void
+size_rx_socket(int sockfd, unsigned int depth)
+{
+	int optval;
+	socklen_t optlen;
 
-	hdr = (struct compressed_header *)buf;
-	sig = ntohl(hdr->sig);
-	if (sig != 0xcafebabe) {
-		if (fverbose)
-			warnx("Received corrupt packet: %lx\n",
-			      (unsigned long)sig);
-		free(cbuf->buf);
-		free(cbuf);
+	optval = depth * RCVBUF_TRUESIZE;
+	if (optval <= stats.rx_rcvbuf)
+		return;
+
+	/* The kernel doubles this for bookkeeping overhead
+	 * and clamps it to its own maximum */
+	if (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF,
+		       &optval, sizeof(optval)) < 0) {
+		warn("setsockopt SO_RCVBUF");
 		return;
 	}
-	cbuf->hdr = hdr;
 
-	enqueue_for_playback(cbuf);
+	optlen = sizeof(stats.rx_rcvbuf);
+	if (getsockopt(sockfd, SOL_SOCKET, SO_RCVBUF,
+		       &stats.rx_rcvbuf, &optlen) < 0)
+		warn("getsockopt");
+	log_event(LOG_RCVBUF, stats.rx_rcvbuf, 0, 0);
 }
 
-/* Input PCM thread, outbound path */
-static void *
-capture(void *data)
+/* Receive a packet, @arrival is set to the time the
+ * kernel got it in ns since the epoch */
+static ssize_t
+receive_packet(int sockfd, void *buf, size_t len,
+	       struct sockaddr_storage *addr, socklen_t *addr_len,
+	       uint64_t *arrival)
 {
-	struct capture_state *state = data;
-	spx_int16_t *inbuf;
-	unsigned char outbuf[COMPRESSED_BUF_SIZE];
-	char inbuf_sample_convert[FRAME_SIZE];
-	ssize_t inbytes, bytes;
-	opus_int32 outbytes;
-	spx_uint32_t inlen;
-	spx_uint32_t outlen;
-	ssize_t ret;
-	int timestamp;
-	struct compressed_header *hdr;
-	opus_int32 max_data_bytes;
+	char control[CMSG_SPACE(sizeof(struct timespec)) +
+		     CMSG_SPACE(sizeof(uint32_t))];
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	struct timespec ts;
+	ssize_t bytes;
 
-	/* Prepare Speex resampler configuration */
-	outlen = FRAME_SIZE;
-	inbytes = (FRAME_SIZE * frate) / 8000;
-	inbytes *= frate;
-	inbytes /= frate;
-	inbuf = malloc(inbytes);
-	if (!inbuf)
-		err(1, "malloc");
+	iov.iov_base = buf;
+	iov.iov_len = len;
 
-	timestamp = 0;
-	do {
-		pthread_mutex_lock(&capture_state_lock);
-		if (state->quit) {
-			pthread_mutex_unlock(&capture_state_lock);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = addr;
+	msg.msg_namelen = *addr_len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	bytes = recvmsg(sockfd, &msg, MSG_DONTWAIT);
+	if (bytes < 0)
+		return bytes;
+	*addr_len = msg.msg_namelen;
+
+	*arrival = 0;
+	for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+		if (cm->cmsg_level != SOL_SOCKET)
+			continue;
+		switch (cm->cmsg_type) {
+#if defined(SCM_TIMESTAMPNS)
+		case SCM_TIMESTAMPNS:
+			memcpy(&ts, CMSG_DATA(cm), sizeof(ts));
+			*arrival = (uint64_t)ts.tv_sec * 1000000000ULL +
+				ts.tv_nsec;
 			break;
-		}
-		pthread_mutex_unlock(&capture_state_lock);
+#elif defined(SCM_TIMESTAMP)
+		case SCM_TIMESTAMP: {
+			struct timeval tv;
 
-		bytes = read(capture_priv.fd, inbuf, inbytes);
-		if (bytes > 0) {
-			/* Input length should be in frames */
-			inlen = bytes / 2;
-			/* Sampler convert the TX path */
-			speex_resampler_process_int(speex_resampler_tx,
-						    0, (void *)inbuf, &inlen,
-						    (void *)inbuf_sample_convert,
-						    &outlen);
-
-			/* Encode input buffer */
-			max_data_bytes = sizeof(outbuf) - sizeof(*hdr);
-			outbytes = opus_encode(opus_enc,
-					       (const void *)inbuf_sample_convert,
-					       FRAME_SIZE, outbuf + sizeof(*hdr),
-					       max_data_bytes);
-			if (outbytes < 0) {
-				warnx("Failed to encode packet: %d", outbytes);
-			} else if (outbytes == 1) {
-				/* Don't need to transmit this one */
-				continue;
-			} else {
-				/* Pre-append the header */
-				hdr = (struct compressed_header *)outbuf;
-				hdr->sig = htonl(0xcafebabe);
-				hdr->timestamp = htonl(timestamp);
-				timestamp += FRAME_SIZE;
-
-				/* Send the buffer out */
-				ret = sendto(capture_priv.sockfd, outbuf,
-					     outbytes + sizeof(*hdr), 0,
-					     capture_priv.servinfo->ai_addr,
-					     capture_priv.servinfo->ai_addrlen);
-				if (ret < 0)
-					warn("sendto");
-			}
+			memcpy(&tv, CMSG_DATA(cm), sizeof(tv));
+			*arrival = (uint64_t)tv.tv_sec * 1000000000ULL +
+				tv.tv_usec * 1000ULL;
+			break;
 		}
-	} while (1);
+#endif
+#ifdef SO_RXQ_OVFL
+		case SO_RXQ_OVFL: {
+			uint32_t drops;
 
-	free(inbuf);
+			/* This is a running total for the socket */
+			memcpy(&drops, CMSG_DATA(cm), sizeof(drops));
+			stats.rx_queue_drops = drops;
+			break;
+		}
+#endif
+		default:
+			break;
+		}
+	}
 
-	pthread_exit(NULL);
+	if (!*arrival) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		*arrival = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	}
 
-	return NULL;
+	return bytes;
 }
 
+/* Set up pacing on the client socket.  The kernel only
+ * paces if asked to with -P: setsockopt(SO_TXTIME) succeeds
+ * whatever the qdisc, and without fq or etf on the interface
+ * the departure time is silently ignored.  Otherwise, or if
+ * SO_TXTIME is missing, start the pacer. */
 static void
-usage(void)
+init_pacer(int sockfd)
 {
-	fprintf(stderr,
-		"usage: %s [OPTIONS] <remote-addr> <remote-port> <local-port>\n", argv0);
-	fprintf(stderr, " -b\tBits per sample\n");
-	fprintf(stderr, " -r\tSamples per second (in a single channel)\n");
-	fprintf(stderr, " -c\tNumber of channels\n");
-	fprintf(stderr, " -d\tOverride default driver ID\n");
-	fprintf(stderr, " -v\tEnable verbose output\n");
-	fprintf(stderr, " -V\tPrint version information\n");
-	fprintf(stderr, " -h\tThis help screen\n");
-}
+	int ret;
+#ifdef SO_TXTIME
+	struct txtime_cfg txt;
 
-static void
-sig_handler(int signum)
-{
-	switch (signum) {
-	case SIGINT:
-		handle_sigint = 1;
-		break;
-	case SIGUSR1:
-		fverbose = !fverbose;
-		break;
-	default:
-		break;
+	if (fpace_kernel) {
+		memset(&txt, 0, sizeof(txt));
+		txt.clockid = CLOCK_MONOTONIC;
+		txt.flags = 0;
+		ret = setsockopt(sockfd, SOL_SOCKET, SO_TXTIME,
+				 &txt, sizeof(txt));
+		if (!ret) {
+			pacer_state.txtime = 1;
+			return;
+		}
+		warn("SO_TXTIME, pacing in userspace");
+	}
+#else
+	(void)sockfd;
+	if (fpace_kernel)
+		warnx("No SO_TXTIME, pacing in userspace");
+#endif
+
+	INIT_LIST_HEAD(&paced_buf.list);
+	pthread_mutex_init(&paced_buf_lock, NULL);
+	pthread_cond_init(&paced_buf_cond, NULL);
+
+	ret = pthread_create(&pacer_thread, &thread_attr,
+			     pacer, &pacer_state);
+	if (ret) {
+		errno = ret;
+		err(1, "pthread_create");
 	}
 }
 
 static void
-set_nonblocking(int fd)
+deinit_pacer(void)
 {
-	int opts;
+	if (!fpace || pacer_state.txtime)
+		return;
 
-	opts = fcntl(fd, F_GETFL);
-	if (opts < 0)
-		err(1, "fcntl");
-	opts = (opts | O_NONBLOCK);
-	if (fcntl(fd, F_SETFL, opts) < 0)
-		err(1, "fcntl");
+	pthread_mutex_lock(&paced_buf_lock);
+	pacer_state.quit = 1;
+	pthread_cond_signal(&paced_buf_cond);
+	pthread_mutex_unlock(&paced_buf_lock);
+
+	pthread_join(pacer_thread, NULL);
 }
 
 static void
@@ -407,19 +4728,45 @@ init_speexdsp(void)
 	int tmp;
 
 	/* Init Speex resampler */
-	speex_resampler_tx = speex_resampler_init(fchan, frate,
+	speex_resampler_tx = speex_resampler_init(fchan, in_rate,
 						  16000,
 						  SPEEX_RESAMPLER_QUALITY_DESKTOP,
 						  &tmp);
-	speex_resampler_rx = speex_resampler_init(fchan, 16000,
-						  frate,
-						  SPEEX_RESAMPLER_QUALITY_DESKTOP,
-						  &tmp);
+
+	if (faec >= 0) {
+		speex_echo = speex_echo_state_init(FRAME_SIZE, AEC_TAIL * 16);
+		tmp = 16000;
+		speex_echo_ctl(speex_echo, SPEEX_ECHO_SET_SAMPLING_RATE, &tmp);
+		speex_resampler_ref = speex_resampler_init(fchan, frate, 16000,
+							   SPEEX_RESAMPLER_QUALITY_VOIP,
+							   &tmp);
+		if (ring_init(&aec_ring, AEC_REF,
+			      sizeof(struct aec_ref)) < 0)
+			err(1, "malloc");
+	}
+
+	if (fpreprocess) {
+		speex_preprocess = speex_preprocess_state_init(FRAME_SIZE,
+							       16000);
+		tmp = 1;
+		speex_preprocess_ctl(speex_preprocess,
+				     SPEEX_PREPROCESS_SET_DENOISE, &tmp);
+		speex_preprocess_ctl(speex_preprocess,
+				     SPEEX_PREPROCESS_SET_AGC, &tmp);
+		/* It also takes out the echo the canceller
+		 * left behind */
+		if (speex_echo)
+			speex_preprocess_ctl(speex_preprocess,
+					     SPEEX_PREPROCESS_SET_ECHO_STATE,
+					     speex_echo);
+	}
 }
 
 static void
 init_opus(void)
 {
+	OpusDecoder *dec;
+	SpeexResamplerState *resampler;
 	int error;
 
 	opus_enc = opus_encoder_create(16000, fchan,
@@ -429,11 +4776,54 @@ init_opus(void)
 		     opus_strerror(error));
 	}
 
-	opus_dec = opus_decoder_create(16000, fchan, &error);
-	if (error != OPUS_OK) {
-		errx(1, "Cannot create opus decoder: %s",
-		     opus_strerror(error));
+	/* Let the encoder thin out what the VAD lets through */
+	if (fvad)
+		opus_encoder_ctl(opus_enc, OPUS_SET_DTX(1));
+
+	/* The governor starts from the library default */
+	opus_encoder_ctl(opus_enc, OPUS_GET_COMPLEXITY(&tx_gov.complexity));
+	stats.tx_complexity = tx_gov.complexity;
+	stats.tx_codec_bytes = opus_encoder_get_size(fchan);
+
+	/* Fill the pool while allocating is still cheap */
+	while (codec_pool.allocated < CODEC_POOL) {
+		codec_get(&dec, &resampler);
+		codec_put(dec, resampler);
+	}
+	if (opus_decoder_ctl(codec_pool.dec[0],
+			     OPUS_GET_COMPLEXITY(&codec_pool.complexity)) !=
+	    OPUS_OK) {
+		codec_pool.complexity = -1;
+		stats.rx_shed_refused++;
+	}
+}
+
+static void
+init_crypto(void)
+{
+	crypto_random(&tx_ssrc, sizeof(tx_ssrc));
+
+	if (fnocrypt)
+		return;
+
+	if (fkeyfile) {
+		crypto_read_psk(fkeyfile, handshake.psk);
+		handshake.have_psk = 1;
 	}
+	if (fticketfile)
+		load_ticket(&handshake.ticket);
+
+	tx_cipher = crypto_best_cipher();
+	crypto_enabled = 1;
+}
+
+static void
+deinit_crypto(void)
+{
+	crypto_free(&tx_crypto);
+	crypto_free(&rx_crypto);
+	memset(&handshake, 0, sizeof(handshake));
+	memset(&capture_state.tx_key, 0, sizeof(capture_state.tx_key));
 }
 
 static void
@@ -447,14 +4837,25 @@ static void
 deinit_speexdsp(void)
 {
 	speex_resampler_destroy(speex_resampler_tx);
-	speex_resampler_destroy(speex_resampler_rx);
+	if (speex_echo) {
+		speex_echo_state_destroy(speex_echo);
+		speex_resampler_destroy(speex_resampler_ref);
+		ring_free(&aec_ring);
+	}
+	if (speex_preprocess)
+		speex_preprocess_state_destroy(speex_preprocess);
 }
 
 static void
 deinit_opus(void)
 {
 	opus_encoder_destroy(opus_enc);
-	opus_decoder_destroy(opus_dec);
+	if (rx_codec.dec)
+		codec_put(rx_codec.dec, rx_codec.resampler);
+	while (codec_pool.count--) {
+		opus_decoder_destroy(codec_pool.dec[codec_pool.count]);
+		speex_resampler_destroy(codec_pool.resampler[codec_pool.count]);
+	}
 }
 
 int
@@ -470,8 +4871,15 @@ main(int argc, char *argv[])
 	int ret;
 	socklen_t addr_len;
 	struct sockaddr_storage their_addr;
-	char host[NI_MAXHOST];
 	int optval;
+	uint64_t arrival, arrival_now, queue_drops;
+	unsigned int burst;
+	int reason;
+	struct pollfd pfd[3 + CTL_MAX_CLIENTS];
+	struct timespec ts;
+	int npfd;
+	char *cpus, *cpu, *rtopt;
+	int i;
 
         ARGBEGIN {
         case 'h':
@@ -490,6 +4898,80 @@ main(int argc, char *argv[])
         case 'd':
                 fdevid = strtol(EARGF(usage()), NULL, 10);
                 break;
+        case 'k':
+                fkeyfile = EARGF(usage());
+                break;
+        case 't':
+                fticketfile = EARGF(usage());
+                break;
+        case 'n':
+                fnocrypt = 1;
+                break;
+        case 'A':
+                fanysrc = 1;
+                break;
+        case 's':
+                fctlpath = EARGF(usage());
+                break;
+        case 'p':
+                fpace = strtol(EARGF(usage()), NULL, 10);
+                break;
+        case 'P':
+                fpace_kernel = 1;
+                break;
+        case 'R':
+                rtopt = EARGF(usage());
+                if (!strncmp(rtopt, "rr:", 3)) {
+                        frtpolicy = SCHED_RR;
+                        rtopt += 3;
+                }
+                frtprio = strtol(rtopt, NULL, 10);
+                break;
+        case 'C':
+                cpus = EARGF(usage());
+                for (i = 0; i < NR_RT_THREADS &&
+                     (cpu = strsep(&cpus, ",")); i++)
+                        fcpu[i] = *cpu ? strtol(cpu, NULL, 10) : -1;
+                break;
+        case 'L':
+                fmlock = 1;
+                break;
+        case 'S':
+                fserial = 1;
+                break;
+        case 'D':
+                fvad = 1;
+                break;
+        case 'N':
+                fpreprocess = 1;
+                break;
+        case 'H':
+                fhibernate = strtol(EARGF(usage()), NULL, 10);
+                if (fhibernate < 0)
+                        fhibernate = 0;
+                break;
+        case 'w':
+                frecord = EARGF(usage());
+                break;
+        case 'i':
+                finput = EARGF(usage());
+                break;
+        case 'f':
+                fplay = EARGF(usage());
+                break;
+        case 'o':
+                fplay_start = strtol(EARGF(usage()), NULL, 10);
+                if (fplay_start < 0)
+                        fplay_start = 0;
+                break;
+        case 'W':
+                fprompt = EARGF(usage());
+                break;
+        case 'E':
+                faec = strtol(EARGF(usage()), NULL, 10);
+                if (faec < 0)
+                        faec = 0;
+                break;
         case 'v':
                 fverbose = 1;
                 break;
@@ -501,7 +4983,7 @@ main(int argc, char *argv[])
                 exit(1);
         } ARGEND
 
-	if (argc != 3) {
+	if (argc != (fprompt ? 0 : 3)) {
 		usage();
 		exit(1);
 	}
@@ -517,16 +4999,51 @@ main(int argc, char *argv[])
 
 	if (!frate)
 		frate = 16000;
+	else if (frate < PCM_RATE_MIN || frate > PCM_RATE_MAX ||
+		 FRAME_SIZE * frate % 16000)
+		errx(1, "Unsupported sample rate: %d", frate);
 
+	if (fpace < 0)
+		errx(1, "Invalid pacing offset: %d", fpace);
+
+	if (frtprio && (frtprio < sched_get_priority_min(frtpolicy) ||
+			frtprio > sched_get_priority_max(frtpolicy)))
+		errx(1, "Invalid real-time priority: %d", frtprio);
+
+	init_input();
+
+	/* Nothing but the encoder is needed for that */
+	if (fprompt) {
+		init_speexdsp();
+		init_opus();
+		build_prompt();
+		deinit_opus();
+		deinit_speexdsp();
+		deinit_input();
+		return 0;
+	}
+
+	init_rt();
+	init_log();
+	init_ctl();
 	init_ao(frate, fbits, fchan, &fdevid);
 	init_speexdsp();
 	init_opus();
+	init_crypto();
 
 	if (fverbose) {
 		printf("Bits per sample: %d\n", fbits);
 		printf("Number of channels: %d\n", fchan);
 		printf("Sample rate: %d\n", frate);
+		if (finput)
+			printf("Input: %s, %u bit, %u channels, %u Hz\n",
+			       input_file.fmt.offset ? "WAV" : "raw",
+			       input_file.fmt.bits, input_file.fmt.channels,
+			       input_file.fmt.rate);
 		printf("Default driver ID: %d\n", fdevid);
+		if (crypto_enabled)
+			printf("Cipher: %s\n", tx_cipher == CIPHER_AES_GCM ?
+			       "AES-256-GCM" : "ChaCha20-Poly1305");
 		fflush(stdout);
 	}
 
@@ -549,6 +5066,8 @@ main(int argc, char *argv[])
 	if (!p0)
 		errx(1, "failed to bind socket");
 
+	memcpy(&peer_addr, p0->ai_addr, sizeof(peer_addr));
+
 	memset(&srv_hints, 0, sizeof(srv_hints));
 	srv_hints.ai_family = AF_INET;
 	srv_hints.ai_socktype = SOCK_DGRAM;
@@ -582,6 +5101,8 @@ main(int argc, char *argv[])
 	if (!p1)
 		errx(1, "failed to bind socket");
 
+	init_rx_socket(srv_sockfd);
+
 	INIT_LIST_HEAD(&compressed_buf.list);
 
 	pthread_mutex_init(&compressed_buf_lock, NULL);
@@ -590,13 +5111,28 @@ main(int argc, char *argv[])
 	pthread_mutex_init(&playback_state_lock, NULL);
 	pthread_mutex_init(&capture_state_lock, NULL);
 
-	ret = pthread_create(&playback_thread, NULL,
+	pcm_frame_len = FRAME_SIZE * frate / 16000;
+	pcm_frame_max = pcm_frame_len + 8;
+	if (ring_init(&pcm_ring, PCM_LOOKAHEAD, sizeof(struct pcm_frame) +
+		      pcm_frame_max * sizeof(spx_int16_t)) < 0)
+		err(1, "malloc");
+	sem_init(&pcm_free, 0, PCM_LOOKAHEAD);
+	sem_init(&pcm_ready, 0, 0);
+
+	ret = pthread_create(&playback_thread, &thread_attr,
 			     playback, &playback_state);
 	if (ret) {
 		errno = ret;
 		err(1, "pthread_create");
 	}
 
+	ret = pthread_create(&decode_thread, &thread_attr,
+			     decoder, &playback_state);
+	if (ret) {
+		errno = ret;
+		err(1, "pthread_create");
+	}
+
 	capture_priv.fd = recfd;
 	capture_priv.sockfd = cli_sockfd;
 	capture_priv.servinfo = p0;
@@ -604,22 +5140,70 @@ main(int argc, char *argv[])
 	set_nonblocking(capture_priv.fd);
 	set_nonblocking(capture_priv.sockfd);
 
-	ret = pthread_create(&capture_thread, NULL,
-			     capture, &capture_state);
+	if (fpace)
+		init_pacer(capture_priv.sockfd);
+
+	init_capture();
+	init_play();
+
+	ret = pthread_create(&capture_thread, &thread_attr,
+			     fplay ? play : capture, &capture_state);
 	if (ret) {
 		errno = ret;
 		err(1, "pthread_create");
 	}
 
+	wakeups_since = now_ns();
+
+	if (pipe(sig_pipe) < 0)
+		err(1, "pipe");
+	set_nonblocking(sig_pipe[0]);
+	set_nonblocking(sig_pipe[1]);
+
 	if (signal(SIGINT, sig_handler) == SIG_ERR)
 		err(1, "signal");
 
 	if (signal(SIGUSR1, sig_handler) == SIG_ERR)
 		err(1, "signal");
 
+	if (signal(SIGUSR2, sig_handler) == SIG_ERR)
+		err(1, "signal");
+
+	burst = 0;
+	queue_drops = 0;
+	bytes = -1;
+
+	timer_wheel_init(&timers, now_ns() / 1000000);
+	timer_init(&hello_timer, hello_expired);
+	timer_init(&hibernate_timer, hibernate_expired);
+	init_record();
+
+	/* Only now, threads inherit the scheduling and CPU of
+	 * their creator and the disk writer is not real-time */
+	rt_attach(RT_RECEIVE);
+
+	/* Say hello, resuming from the ticket if we have one */
+	if (crypto_enabled)
+		start_handshake(1);
+
 	/* Main processing loop, receive compressed data,
 	 * parse and prepare for playback */
 	do {
+		/* Sleep once the socket is drained, until a
+		 * packet, a signal or the next timer is due */
+		if (bytes < 0) {
+			pfd[0].fd = srv_sockfd;
+			pfd[0].events = POLLIN;
+			pfd[1].fd = sig_pipe[0];
+			pfd[1].events = POLLIN;
+			npfd = 2 + ctl_pollfds(&pfd[2]);
+			if (poll(pfd, npfd, timer_next(&timers)) < 0 &&
+			    errno != EINTR)
+				err(1, "poll");
+			wakeup_add();
+			drain_pipe(sig_pipe[0]);
+		}
+
 		/* Handle SIGINT gracefully */
 		if (handle_sigint) {
 			if (fverbose)
@@ -627,24 +5211,55 @@ main(int argc, char *argv[])
 			break;
 		}
 
+		if (handle_sigusr2) {
+			handle_sigusr2 = 0;
+			dump_stats(stdout);
+		}
+
+		timer_run(&timers, now_ns() / 1000000);
+		ctl_poll();
+
 		addr_len = sizeof(their_addr);
-		bytes = recvfrom(srv_sockfd, buf,
-				 sizeof(buf), MSG_DONTWAIT,
-				 (struct sockaddr *)&their_addr,
-				 &addr_len);
+		bytes = receive_packet(srv_sockfd, buf, sizeof(buf),
+				       &their_addr, &addr_len, &arrival);
+		if (bytes < 0) {
+			/* End of a burst, make sure the next one
+			 * of that size fits in the socket buffer */
+			if (burst > stats.rx_burst_max) {
+				stats.rx_burst_max = burst;
+				size_rx_socket(srv_sockfd, burst * 2);
+			}
+			burst = 0;
+			/* The kernel dropped some, we were too small */
+			if (stats.rx_queue_drops != queue_drops) {
+				queue_drops = stats.rx_queue_drops;
+				size_rx_socket(srv_sockfd,
+					       stats.rx_burst_max * 4);
+			}
+		} else {
+			/* How long the packet sat in the socket
+			 * before we got to run */
+			if (!burst) {
+				clock_gettime(CLOCK_REALTIME, &ts);
+				arrival_now = (uint64_t)ts.tv_sec * 1000000000ULL +
+					ts.tv_nsec;
+				if (arrival_now > arrival)
+					sched_lat_add(RT_RECEIVE,
+						      arrival_now - arrival);
+			}
+			burst++;
+		}
 		if (bytes > 0) {
-			if (fverbose) {
-				ret = getnameinfo((struct sockaddr *)&their_addr,
-						  addr_len, host,
-						  sizeof(host), NULL, 0, 0);
-				if (ret < 0) {
-					warn("getnameinfo");
-					snprintf(host, sizeof(host), "unknown");
-				}
-				printf("Received %zd bytes from %s\n",
-				       bytes, host);
+			reason = ingress_filter(buf, bytes, &their_addr,
+						now_ns());
+			if (reason >= 0) {
+				stats.rx_reject[reason]++;
+				continue;
 			}
-			process_compressed_packet(buf, bytes);
+			log_event(LOG_RX_PACKET, bytes,
+				  ((struct sockaddr_in *)&their_addr)->sin_addr.s_addr,
+				  0);
+			process_compressed_packet(buf, bytes, arrival);
 		}
 	} while (1);
 
@@ -653,23 +5268,40 @@ main(int argc, char *argv[])
 	capture_state.quit = 1;
 	pthread_mutex_unlock(&capture_state_lock);
 
-	/* Wait for it */
-	pthread_join(capture_thread, NULL);
+	/* Wait for it and the stages behind it */
+	deinit_capture();
+	deinit_play();
+	deinit_input();
+
+	/* Flush the pacer if there is one */
+	deinit_pacer();
 
 	/* Prepare output thread to be killed */
 	pthread_mutex_lock(&playback_state_lock);
 	playback_state.quit = 1;
 	pthread_mutex_unlock(&playback_state_lock);
 
-	/* Wake up the output thread if it is
-	 * sleeping */
+	/* Wake up the decode and output threads
+	 * if they are sleeping */
 	pthread_mutex_lock(&compressed_buf_lock);
 	pthread_cond_signal(&tx_pcm_cond);
 	pthread_mutex_unlock(&compressed_buf_lock);
+	sem_post(&pcm_free);
+	sem_post(&pcm_ready);
 
-	/* Wait for it */
+	/* Wait for them */
+	pthread_join(decode_thread, NULL);
 	pthread_join(playback_thread, NULL);
+	ring_free(&pcm_ring);
+
+	deinit_record();
+	deinit_log();
+	deinit_ctl();
+
+	if (fverbose)
+		dump_stats(stdout);
 
+	deinit_crypto();
 	deinit_opus();
 	deinit_speexdsp();
 	deinit_ao();
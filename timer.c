@@ -0,0 +1,186 @@
+/* See LICENSE file for copyright and license details */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "list.h"
+#include "timer.h"
+
+#define TIMER_MASK	(TIMER_SLOTS - 1)
+/* Furthest a timer can be put from now */
+#define TIMER_MAX	((1ULL << (TIMER_BITS * TIMER_LEVELS)) - 1)
+
+/* Slot index of @expires on @level */
+#define SLOT(expires, level) \
+	(((expires) >> ((level) * TIMER_BITS)) & TIMER_MASK)
+
+void
+timer_wheel_init(struct timer_wheel *w, uint64_t now)
+{
+	int i, j;
+
+	w->now = now + 1;
+	w->count = 0;
+	for (i = 0; i < TIMER_LEVELS; i++)
+		for (j = 0; j < TIMER_SLOTS; j++)
+			INIT_HLIST_HEAD(&w->slots[i][j]);
+}
+
+void
+timer_init(struct timer *t, void (*fn)(struct timer *))
+{
+	INIT_HLIST_NODE(&t->node);
+	t->expires = 0;
+	t->fn = fn;
+}
+
+int
+timer_pending(const struct timer *t)
+{
+	return !hlist_unhashed(&t->node);
+}
+
+/* Put @t in the slot for its expiry, on the lowest level
+ * that reaches that far.  Timers already due go in the
+ * slot that runs next. */
+static void
+timer_link(struct timer_wheel *w, struct timer *t)
+{
+	uint64_t expires = t->expires, delta;
+	int level;
+
+	if (expires < w->now)
+		expires = w->now;
+	delta = expires - w->now;
+	if (delta > TIMER_MAX) {
+		delta = TIMER_MAX;
+		expires = w->now + delta;
+	}
+	for (level = 0; level < TIMER_LEVELS - 1; level++)
+		if (delta < 1ULL << ((level + 1) * TIMER_BITS))
+			break;
+	hlist_add_head(&t->node, &w->slots[level][SLOT(expires, level)]);
+}
+
+void
+timer_mod(struct timer_wheel *w, struct timer *t, uint64_t expires)
+{
+	if (timer_pending(t))
+		hlist_del_init(&t->node);
+	else
+		w->count++;
+	t->expires = expires;
+	timer_link(w, t);
+}
+
+void
+timer_del(struct timer_wheel *w, struct timer *t)
+{
+	if (!timer_pending(t))
+		return;
+	hlist_del_init(&t->node);
+	w->count--;
+}
+
+/* Spread the timers in the current slot of @level over
+ * the level below, returns the slot index */
+static unsigned int
+timer_cascade(struct timer_wheel *w, int level)
+{
+	struct hlist_head list;
+	struct hlist_node *pos, *n;
+	unsigned int slot = SLOT(w->now, level);
+
+	hlist_move_list(&w->slots[level][slot], &list);
+	hlist_for_each_safe(pos, n, &list) {
+		INIT_HLIST_NODE(pos);
+		timer_link(w, hlist_entry(pos, struct timer, node));
+	}
+	return slot;
+}
+
+/* Ticks from the next one to run until the first that
+ * has something to do, -1 with no timer pending */
+static int
+timer_due(const struct timer_wheel *w)
+{
+	uint64_t next = TIMER_MAX, at;
+	unsigned int i, first;
+	int level, shift;
+
+	if (!w->count)
+		return -1;
+
+	for (i = 0; i < TIMER_SLOTS; i++) {
+		if (!hlist_empty(&w->slots[0][SLOT(w->now + i, 0)])) {
+			next = i;
+			break;
+		}
+	}
+
+	/* Or the first slot above that is brought down, it may
+	 * hold timers due before those on the lowest level.
+	 * The current slot of a level was already, unless the
+	 * next tick starts it. */
+	for (level = 1; level < TIMER_LEVELS && next; level++) {
+		shift = level * TIMER_BITS;
+		first = (w->now & ((1ULL << shift) - 1)) ? 1 : 0;
+		for (i = first; i < first + TIMER_SLOTS; i++) {
+			at = ((w->now >> shift) + i) << shift;
+			if (hlist_empty(&w->slots[level][SLOT(at, level)]))
+				continue;
+			if (at - w->now < next)
+				next = at - w->now;
+			break;
+		}
+	}
+	return next > INT32_MAX ? INT32_MAX : (int)next;
+}
+
+void
+timer_run(struct timer_wheel *w, uint64_t now)
+{
+	struct hlist_head list;
+	struct hlist_node *pos;
+	struct timer *t;
+	int level, next;
+
+	while (w->now <= now) {
+		/* Skip the ticks with nothing to do at once */
+		next = timer_due(w);
+		if (next < 0 || w->now + next > now) {
+			w->now = now + 1;
+			break;
+		}
+		w->now += next;
+
+		/* A lap of a level is over, bring the next
+		 * slot of the level above down */
+		for (level = 1; level < TIMER_LEVELS; level++)
+			if (SLOT(w->now, level - 1) ||
+			    timer_cascade(w, level))
+				break;
+
+		/* Move on first, timers the handlers add for now
+		 * go in the next slot */
+		hlist_move_list(&w->slots[0][SLOT(w->now, 0)], &list);
+		w->now++;
+		while ((pos = list.first)) {
+			hlist_del_init(pos);
+			w->count--;
+			t = hlist_entry(pos, struct timer, node);
+			t->fn(t);
+		}
+	}
+}
+
+int
+timer_next(const struct timer_wheel *w)
+{
+	int due;
+
+	due = timer_due(w);
+	if (due < 0 || due == INT32_MAX)
+		return due;
+	return due + 1;
+}
@@ -0,0 +1,48 @@
+/* See LICENSE file for copyright and license details */
+
+#ifndef TIMER_H__
+#define TIMER_H__
+
+#include <stdint.h>
+
+#include "types.h"
+
+/* Hierarchical timer wheel, times are in ms.  Timers live
+ * in the structure they belong to, adding, moving and
+ * removing one is O(1) and never allocates.  A wheel and
+ * its timers are used by a single thread. */
+
+#define TIMER_BITS	6
+#define TIMER_SLOTS	(1 << TIMER_BITS)
+#define TIMER_LEVELS	4
+
+struct timer {
+	struct hlist_node node;
+	uint64_t expires;
+	void (*fn)(struct timer *);
+};
+
+struct timer_wheel {
+	/* Next tick to run */
+	uint64_t now;
+	/* Timers pending */
+	unsigned int count;
+	struct hlist_head slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+void timer_wheel_init(struct timer_wheel *w, uint64_t now);
+void timer_init(struct timer *t, void (*fn)(struct timer *));
+/* Fire @t at @expires, moving it if it is pending.  Beyond
+ * the reach of the wheel, about four and a half hours, it
+ * fires early. */
+void timer_mod(struct timer_wheel *w, struct timer *t, uint64_t expires);
+void timer_del(struct timer_wheel *w, struct timer *t);
+int timer_pending(const struct timer *t);
+/* Fire every timer due by @now */
+void timer_run(struct timer_wheel *w, uint64_t now);
+/* Time in ms from the last timer_run() until it has
+ * something to do, for poll(), -1 with no timer pending.
+ * It may be early for timers far out, never late. */
+int timer_next(const struct timer_wheel *w);
+
+#endif
@@ -0,0 +1,110 @@
+/* See LICENSE file for copyright and license details */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "bytes.h"
+#include "wav.h"
+
+#define WAVE_FORMAT_PCM		0x0001
+#define WAVE_FORMAT_EXTENSIBLE	0xfffe
+/* Channels mixed down at most */
+#define WAV_MAX_CHANNELS	8
+
+int
+wav_parse(const uint8_t *data, size_t size, struct pcm_format *fmt)
+{
+	const uint8_t *chunk;
+	size_t off, len;
+	unsigned int tag;
+	int have_fmt = 0;
+
+	if (size < 12 || memcmp(data, "RIFF", 4) ||
+	    memcmp(data + 8, "WAVE", 4))
+		return -1;
+
+	for (off = 12; off + 8 <= size; off += len + (len & 1)) {
+		chunk = data + off;
+		len = get32(chunk + 4);
+		off += 8;
+
+		if (!memcmp(chunk, "data", 4)) {
+			if (!have_fmt)
+				return -2;
+			/* Written while recording, the size may
+			 * not have been filled in */
+			if (len > size - off)
+				len = size - off;
+			fmt->offset = off;
+			fmt->len = len - len % pcm_frame_bytes(fmt);
+			return 0;
+		}
+
+		if (len > size - off)
+			break;
+		if (memcmp(chunk, "fmt ", 4))
+			continue;
+		if (len < 16)
+			return -2;
+		tag = get16(chunk + 8);
+		/* The sub-format GUID starts with the tag */
+		if (tag == WAVE_FORMAT_EXTENSIBLE && len >= 40)
+			tag = get16(chunk + 32);
+		fmt->channels = get16(chunk + 10);
+		fmt->rate = get32(chunk + 12);
+		fmt->bits = get16(chunk + 22);
+		if (tag != WAVE_FORMAT_PCM ||
+		    fmt->rate < PCM_RATE_MIN || fmt->rate > PCM_RATE_MAX ||
+		    !fmt->channels || fmt->channels > WAV_MAX_CHANNELS ||
+		    (fmt->bits != 8 && fmt->bits != 16 &&
+		     fmt->bits != 24 && fmt->bits != 32))
+			return -2;
+		have_fmt = 1;
+	}
+	return -2;
+}
+
+size_t
+pcm_frame_bytes(const struct pcm_format *fmt)
+{
+	return fmt->channels * fmt->bits / 8;
+}
+
+void
+pcm_to_s16(const struct pcm_format *fmt, const uint8_t *in,
+	   unsigned int frames, int16_t *out)
+{
+	unsigned int i, c;
+	int32_t sum, s;
+
+	/* The common case is a copy */
+	if (fmt->bits == 16 && fmt->channels == 1) {
+		for (i = 0; i < frames; i++, in += 2)
+			out[i] = (int16_t)get16(in);
+		return;
+	}
+
+	for (i = 0; i < frames; i++) {
+		sum = 0;
+		for (c = 0; c < fmt->channels; c++) {
+			switch (fmt->bits) {
+			case 8:
+				s = (*in - 128) * 256;
+				break;
+			case 16:
+				s = (int16_t)get16(in);
+				break;
+			case 24:
+				s = (int16_t)get16(in + 1);
+				break;
+			default:
+				s = (int16_t)get16(in + 2);
+				break;
+			}
+			sum += s;
+			in += fmt->bits / 8;
+		}
+		out[i] = sum / (int32_t)fmt->channels;
+	}
+}
@@ -0,0 +1,36 @@
+/* See LICENSE file for copyright and license details */
+
+#ifndef WAV_H__
+#define WAV_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Sample rates taken from an input file */
+#define PCM_RATE_MIN	8000
+#define PCM_RATE_MAX	192000
+
+/* Layout of the PCM samples in an input file */
+struct pcm_format {
+	unsigned int rate;
+	/* 8 bit samples are unsigned, wider ones signed
+	 * and little endian */
+	unsigned int bits;
+	unsigned int channels;
+	/* Where the samples are in the file */
+	size_t offset;
+	size_t len;
+};
+
+/* Read the format out of a RIFF WAVE header.  Returns 0
+ * on success, -1 if @data is not a WAV file and -2 if its
+ * samples are not integer PCM we can take. */
+int wav_parse(const uint8_t *data, size_t size, struct pcm_format *fmt);
+/* Bytes per frame of samples across all channels */
+size_t pcm_frame_bytes(const struct pcm_format *fmt);
+/* Turn @frames frames at @in into 16 bit mono samples,
+ * channels are mixed down */
+void pcm_to_s16(const struct pcm_format *fmt, const uint8_t *in,
+		unsigned int frames, int16_t *out);
+
+#endif